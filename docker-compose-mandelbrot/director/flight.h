@@ -0,0 +1,186 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+/*
+ * Single flight: identical requests arriving while the first one is still
+ * being computed wait for its result, instead of computing it again.
+ *
+ * The first request for a key becomes the leader, and must do the work; the
+ * ones joining later are queued on the key, linked to each other through
+ * their userdata (see http_request_set_userdata), until the leader is done
+ * and takes the list back with flight_leave() to answer them all. The
+ * userdata of a waiting request must not be touched.
+ *
+ * It can be used by several threads at once, and must be included after
+ * httpserver.h.
+ *
+ * Do this:
+ *   #define FLIGHT_IMPLEMENTATION
+ * before including this file in *one* C file to create the implementation.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* --------------------------------------------------------------------
+ *   TYPES
+ * -------------------------------------------------------------------- */
+
+typedef struct flights flights_t;
+
+/* --------------------------------------------------------------------
+ *   PROTOTYPES
+ * -------------------------------------------------------------------- */
+
+flights_t *flights_new(void);
+
+// flight_join() returns 1 if there's no work in flight for the key (of
+// key_size bytes, compared as bytes), in which case request is the leader
+// and must call flight_leave() once done; otherwise request is queued to be
+// answered by the leader and 0 is returned
+int flight_join(flights_t *flights, const void *key, size_t key_size, struct http_request_s *request);
+
+// flight_leave() ends the work for key and returns the requests that joined
+// it, oldest first, each one pointing to the next with its userdata
+struct http_request_s *flight_leave(flights_t *flights, const void *key, size_t key_size);
+
+// flight_joined() returns how many requests have joined work in flight
+uint64_t flight_joined(flights_t *flights);
+
+#endif /* FLIGHT_H */
+
+#ifdef FLIGHT_IMPLEMENTATION
+#ifndef FLIGHT_IMPLEMENTATION_ONCE
+#define FLIGHT_IMPLEMENTATION_ONCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* --------------------------------------------------------------------
+ *   MACROS AND CONSTANTS
+ * -------------------------------------------------------------------- */
+
+#define FLIGHT_BUCKETS 256		// must be a power of two
+
+/* --------------------------------------------------------------------
+ *   TYPES
+ * -------------------------------------------------------------------- */
+
+typedef struct flight {
+	struct flight *next;
+	struct http_request_s *waiters;
+	struct http_request_s *waiters_tail;
+	uint64_t hash;
+	size_t key_size;
+	uint8_t key[];
+} flight_t;
+
+struct flights {
+	pthread_mutex_t lock;
+	flight_t *buckets[FLIGHT_BUCKETS];
+	uint64_t joined;
+};
+
+/* --------------------------------------------------------------------
+ *   CODE
+ * -------------------------------------------------------------------- */
+
+flights_t *flights_new(void)
+{
+	flights_t *flights = (flights_t *)calloc(1, sizeof(flights_t));
+	if (!flights)
+		return NULL;
+	pthread_mutex_init(&flights->lock, NULL);
+	return flights;
+}
+
+static uint64_t flight_hash(const void *key, size_t key_size)
+{
+	// FNV-1a
+	const uint8_t *p = (const uint8_t *)key;
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < key_size; i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// flight_find() returns the link pointing to the flight for key, or to the
+// NULL at the end of its bucket. Called with the lock held.
+static flight_t **flight_find(flights_t *flights, const void *key, size_t key_size, uint64_t hash)
+{
+	flight_t **link = &flights->buckets[hash & (FLIGHT_BUCKETS - 1)];
+	while (*link) {
+		flight_t *flight = *link;
+		if (flight->hash == hash && flight->key_size == key_size && memcmp(flight->key, key, key_size) == 0)
+			break;
+		link = &flight->next;
+	}
+	return link;
+}
+
+int flight_join(flights_t *flights, const void *key, size_t key_size, struct http_request_s *request)
+{
+	uint64_t hash = flight_hash(key, key_size);
+	// allocated before taking the lock, in case request is the leader
+	flight_t *leader = (flight_t *)malloc(sizeof(flight_t) + key_size);
+
+	pthread_mutex_lock(&flights->lock);
+	flight_t **link = flight_find(flights, key, key_size, hash);
+	flight_t *flight = *link;
+	if (flight) {
+		http_request_set_userdata(request, NULL);
+		if (flight->waiters_tail)
+			http_request_set_userdata(flight->waiters_tail, request);
+		else
+			flight->waiters = request;
+		flight->waiters_tail = request;
+		flights->joined++;
+		pthread_mutex_unlock(&flights->lock);
+		free(leader);
+		return 0;
+	}
+	if (leader) {
+		leader->next = NULL;
+		leader->waiters = NULL;
+		leader->waiters_tail = NULL;
+		leader->hash = hash;
+		leader->key_size = key_size;
+		memcpy(leader->key, key, key_size);
+		*link = leader;
+	}
+	// without memory for the flight the work is just not shared
+	pthread_mutex_unlock(&flights->lock);
+	return 1;
+}
+
+struct http_request_s *flight_leave(flights_t *flights, const void *key, size_t key_size)
+{
+	uint64_t hash = flight_hash(key, key_size);
+	struct http_request_s *waiters = NULL;
+
+	pthread_mutex_lock(&flights->lock);
+	flight_t **link = flight_find(flights, key, key_size, hash);
+	flight_t *flight = *link;
+	if (flight) {
+		*link = flight->next;
+		waiters = flight->waiters;
+	}
+	pthread_mutex_unlock(&flights->lock);
+
+	free(flight);
+	return waiters;
+}
+
+uint64_t flight_joined(flights_t *flights)
+{
+	pthread_mutex_lock(&flights->lock);
+	uint64_t joined = flights->joined;
+	pthread_mutex_unlock(&flights->lock);
+	return joined;
+}
+
+#endif /* FLIGHT_IMPLEMENTATION_ONCE */
+#endif /* FLIGHT_IMPLEMENTATION */
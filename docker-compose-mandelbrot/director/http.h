@@ -3,7 +3,7 @@
           Licensing information can be found at the end of the file.
 ------------------------------------------------------------------------------
 
-http.hpp - v1.0 - Basic HTTP protocol implementation over sockets (no https).
+http.hpp - v1.2 - Basic HTTP protocol implementation over sockets (no https).
 
 Do this:
     #define HTTP_IMPLEMENTATION
@@ -34,11 +34,20 @@ typedef struct http_t
     void* response_data;
     } http_t;
 
+typedef struct http_pool_t http_pool_t;
+
 http_t* http_get( char const* url, void* memctx );
+http_t* http_get_headers( char const* url, char const* headers, void* memctx );
 http_t* http_post( char const* url, void const* data, size_t size, void* memctx );
 
+http_pool_t* http_pool_create( void* memctx );
+void http_pool_destroy( http_pool_t* pool );
+http_t* http_get_pooled( http_pool_t* pool, char const* url, char const* headers, void* memctx );
+
 http_status_t http_process( http_t* http );
 
+int http_socket( http_t* http );
+
 void http_release( http_t* http );
 
 #endif /* http_hpp */
@@ -132,6 +141,48 @@ request. When the request is finished (or have failed), the returned `http_t` in
 `http_release`. If the request was invalid, `http_get` returns NULL.
 
 
+http_get_headers
+----------------
+
+    http_t* http_get_headers( char const* url, char const* headers, void* memctx )
+
+Same as `http_get`, but adds `headers` to the request. `headers` is a zero terminated string of complete header lines,
+each one terminated by "\r\n", for example "Accept: image/png\r\n". It can be NULL if no extra headers are needed.
+
+
+http_pool_create
+----------------
+
+    http_pool_t* http_pool_create( void* memctx )
+
+Creates a pool of persistent (keep-alive) connections, to be used with `http_get_pooled`, and destroyed with 
+`http_pool_destroy` once all the requests made with it have been released. The pool also remembers the address each 
+host name resolves to, for `HTTP_POOL_DNS_TTL` seconds (default 30), so that only the first request to a host pays for 
+the name resolution. A pool is not thread safe: all its requests must be made and released by the same thread, or under 
+the same lock. Returns NULL if out of memory.
+
+
+http_pool_destroy
+-----------------
+
+    void http_pool_destroy( http_pool_t* pool )
+
+Closes the idle connections of the pool and releases it.
+
+
+http_get_pooled
+---------------
+
+    http_t* http_get_pooled( http_pool_t* pool, char const* url, char const* headers, void* memctx )
+
+Same as `http_get_headers`, but makes an HTTP/1.1 request over an idle connection to the same host and port taken from 
+`pool`, if there is one, or over a new connection otherwise. When the request is released after its response has been 
+received in full, its connection goes back to the pool, unless the server asked to close it; up to 
+`HTTP_POOL_MAX_IDLE` connections (default 8) are kept for each host, for at most `HTTP_POOL_IDLE_TIMEOUT` seconds 
+(default 60, it must be shorter than the keep-alive timeout of the server). A connection taken from the pool is already 
+established, so its socket is writable right away.
+
+
 http_post
 ---------
 
@@ -159,12 +210,27 @@ contain more details (for example, status code can be 404 if the requested resou
 request completes successfully, it returns `HTTP_STATUS_COMPLETED`. In this case, the `http_t` instance will contain 
 details about the result. `status_code` and `reason_phrase` contains the details about the result, as specified in the
 HTTP protocol. `content_type` contains the MIME type for the returns resource, for example `text/html` for a normal web
-page. `response_data` is the pointer to the received data, and `resonse_size` is the number of bytes it contains. In the
+page. The response is complete when the number of bytes in its `Content-Length` header have been received, or its last
+chunk when it's sent with `Transfer-Encoding: chunked` (the chunks are joined in `response_data`), or else when the
+server closes the connection. The response is received straight into its buffer, allocated with `HTTP_MALLOC` and the 
+`memctx` of the request: a small one for the header, then one of the exact size of the whole response when it has a 
+`Content-Length`, so that `response_data` points to the body as it was received. `response_data` is the pointer to the received data, and `resonse_size` is the number of bytes it contains. In the
 case when the response data is in text format, http.h ensures there is a zero terminator placed immediately after the
 response data block, so it is safe to interpret the resonse data as a `char*`. Note that the data size in this case will 
 be the length of the data without the additional zero terminator.
 
 
+http_socket
+-----------
+
+    int http_socket( http_t* http )
+
+Returns the socket used by the request, so that it can be watched for readiness with `select`, `poll`, `epoll` or 
+similar, and `http_process` called only when there is something to do instead of in a loop. Wait for both 
+readability and writability: the socket becomes writable when the connection is established, and readable when 
+response data arrives. Each call to `http_process` consumes all the data available at that moment.
+
+
 http_release
 ------------
 
@@ -198,6 +264,7 @@ Releases the resources acquired by `http_get` or `http_post`. Should be call whe
     #pragma comment (lib, "Ws2_32.lib") 
     #include <string.h>
     #include <stdio.h>
+    #include <stdlib.h>
     #define HTTP_SOCKET SOCKET
     #define HTTP_INVALID_SOCKET INVALID_SOCKET
 #else
@@ -208,12 +275,19 @@ Releases the resources acquired by `http_get` or `http_post`. Should be call whe
     #include <sys/socket.h>
     #include <unistd.h>
     #include <errno.h>
+    #include <strings.h>
     #include <fcntl.h>
     #include <netdb.h>
+    #include <netinet/in.h>
+    #include <poll.h>
     #define HTTP_SOCKET int
     #define HTTP_INVALID_SOCKET -1
 #endif
 
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+
 #ifndef HTTP_MALLOC
     #define _CRT_NONSTDC_NO_DEPRECATE 
     #define _CRT_SECURE_NO_WARNINGS
@@ -222,6 +296,57 @@ Releases the resources acquired by `http_get` or `http_post`. Should be call whe
     #define HTTP_FREE( ctx, ptr ) ( free( ptr ) )
 #endif
 
+// the response buffer holds the header at first, a body of unknown size grows by at least HTTP_RECV_SIZE bytes at a time
+#define HTTP_HEADER_CAPACITY 4096
+#define HTTP_RECV_SIZE 4096
+
+#ifndef HTTP_POOL_MAX_IDLE
+    #define HTTP_POOL_MAX_IDLE 8
+#endif
+
+#ifndef HTTP_POOL_IDLE_TIMEOUT
+    #define HTTP_POOL_IDLE_TIMEOUT 60
+#endif
+
+#ifndef HTTP_POOL_DNS_TTL
+    #define HTTP_POOL_DNS_TTL 30
+#endif
+
+typedef enum http_framing_t
+    {
+    HTTP_FRAMING_CLOSE, // the response ends when the connection is closed
+    HTTP_FRAMING_LENGTH,
+    HTTP_FRAMING_CHUNKED,
+    } http_framing_t;
+
+typedef enum http_chunk_state_t
+    {
+    HTTP_CHUNK_SIZE,
+    HTTP_CHUNK_DATA,
+    HTTP_CHUNK_DATA_END,
+    HTTP_CHUNK_TRAILER,
+    } http_chunk_state_t;
+
+typedef struct http_pool_host_t
+    {
+    struct http_pool_host_t* next;
+    char address[ 256 ];
+    char port[ 16 ];
+    int resolved;
+    time_t resolved_time;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int idle_count;
+    HTTP_SOCKET idle[ HTTP_POOL_MAX_IDLE ];
+    time_t idle_time[ HTTP_POOL_MAX_IDLE ];
+    } http_pool_host_t;
+
+struct http_pool_t
+    {
+    void* memctx;
+    http_pool_host_t* hosts;
+    };
+
 typedef struct http_internal_t 
     {
     /* keep this at the top!*/ 
@@ -230,6 +355,7 @@ typedef struct http_internal_t
     
     void* memctx;
     HTTP_SOCKET socket;
+    http_pool_host_t* pool_host;
     int connect_pending;
     int request_sent;
     char address[ 256 ];
@@ -242,9 +368,40 @@ typedef struct http_internal_t
     size_t data_size;
     size_t data_capacity;
     void* data;
+    // framing of the response, known once its header has been received
+    size_t header_size;
+    http_framing_t framing;
+    size_t content_length;
+    int keep_alive;
+    int response_complete;
+    // chunked responses are decoded in place, right after the header
+    http_chunk_state_t chunk_state;
+    size_t chunk_remaining;
+    size_t chunk_read_pos;
+    size_t body_size;
     } http_internal_t;
 
 
+static void http_internal_close( HTTP_SOCKET socket )
+    {
+    #ifdef _WIN32
+        closesocket( socket );
+    #else
+        close( socket );
+    #endif
+    }
+
+
+static int http_internal_would_block( void )
+    {
+    #ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+    #else
+        return errno == EWOULDBLOCK || errno == EAGAIN;
+    #endif
+    }
+
+
 static int http_internal_parse_url( char const* url, char* address, size_t address_capacity, char* port, 
     size_t port_capacity, char const** resource )
     {
@@ -291,68 +448,69 @@ static int http_internal_parse_url( char const* url, char* address, size_t addre
     }
 
 
-HTTP_SOCKET http_internal_connect( char const* address, char const* port )
-    {   
-    // set up hints for getaddrinfo
-    struct addrinfo hints;
-    memset( &hints, 0, sizeof( hints ) );
-    hints.ai_family = AF_UNSPEC; // the Internet Protocol version 4 (IPv4) address family.
-    hints.ai_flags = AI_PASSIVE;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;    // Use Transmission Control Protocol (TCP).
-
-    // resolve the server address and port
-    struct addrinfo* addri = 0;
-    int error = getaddrinfo( address, port, &hints, &addri) ;
-    if( error != 0 ) return HTTP_INVALID_SOCKET;
-
+static HTTP_SOCKET http_internal_connect_addr( struct sockaddr const* addr, socklen_t addr_len )
+    {
     // create the socket
-    HTTP_SOCKET sock = socket( addri->ai_family, addri->ai_socktype, addri->ai_protocol );
-    if( sock == -1) 
-        {
-        freeaddrinfo( addri );
-        return HTTP_INVALID_SOCKET;
-        }
+    HTTP_SOCKET sock = socket( addr->sa_family, SOCK_STREAM, IPPROTO_TCP );
+    if( sock == HTTP_INVALID_SOCKET ) return HTTP_INVALID_SOCKET;
 
     // set socket to nonblocking mode
     u_long nonblocking = 1;
     #ifdef _WIN32
         int res = ioctlsocket( sock, FIONBIO, &nonblocking );
     #else
+        (void) nonblocking;
         int flags = fcntl( sock, F_GETFL, 0 );
         int res = fcntl( sock, F_SETFL, flags | O_NONBLOCK ); 
     #endif
     if( res == -1 )
         {
-        freeaddrinfo( addri );
-        #ifdef _WIN32
-            closesocket( sock );
-        #else
-            close( sock );
-        #endif
+        http_internal_close( sock );
         return HTTP_INVALID_SOCKET;
         }
 
     // connect to server
-    if( connect( sock, addri->ai_addr, (int)addri->ai_addrlen ) == -1 )
+    if( connect( sock, addr, (int)addr_len ) == -1 )
         {
         #ifdef _WIN32
             if( WSAGetLastError() != WSAEWOULDBLOCK && WSAGetLastError() != WSAEINPROGRESS )
-                {
-                freeaddrinfo( addri );
-                closesocket( sock );
-                return HTTP_INVALID_SOCKET;
-                }
         #else
             if( errno != EWOULDBLOCK && errno != EINPROGRESS && errno != EAGAIN )
+        #endif
                 {
-                freeaddrinfo( addri );
-                close( sock );
+                http_internal_close( sock );
                 return HTTP_INVALID_SOCKET;
                 }
-        #endif
         }
 
+    return sock;
+    }
+
+
+static struct addrinfo* http_internal_resolve( char const* address, char const* port )
+    {
+    // set up hints for getaddrinfo
+    struct addrinfo hints;
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_UNSPEC; // the Internet Protocol version 4 (IPv4) address family.
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;    // Use Transmission Control Protocol (TCP).
+
+    // resolve the server address and port
+    struct addrinfo* addri = 0;
+    int error = getaddrinfo( address, port, &hints, &addri) ;
+    if( error != 0 ) return NULL;
+    return addri;
+    }
+
+
+HTTP_SOCKET http_internal_connect( char const* address, char const* port )
+    {   
+    struct addrinfo* addri = http_internal_resolve( address, port );
+    if( !addri ) return HTTP_INVALID_SOCKET;
+
+    HTTP_SOCKET sock = http_internal_connect_addr( addri->ai_addr, (socklen_t) addri->ai_addrlen );
     freeaddrinfo( addri );
     return sock;
     }
@@ -368,6 +526,7 @@ static http_internal_t* http_internal_create( size_t request_data_size, void* me
     internal->http.response_data = NULL;
 
     internal->memctx = memctx;
+    internal->pool_host = NULL;
     internal->connect_pending = 1;
     internal->request_sent = 0;
     
@@ -377,18 +536,55 @@ static http_internal_t* http_internal_create( size_t request_data_size, void* me
     strcpy( internal->content_type, "" );
     internal->http.content_type = internal->content_type;
 
+    // enough for the header, the body gets a buffer of its size once it's known (see http_internal_reserve)
     internal->data_size = 0;
-    internal->data_capacity = 64 * 1024;
+    internal->data_capacity = HTTP_HEADER_CAPACITY;
     internal->data = HTTP_MALLOC( memctx, internal->data_capacity );
     
     internal->request_data = NULL;
     internal->request_data_size = 0;
+
+    internal->header_size = 0;
+    internal->framing = HTTP_FRAMING_CLOSE;
+    internal->content_length = 0;
+    internal->keep_alive = 0;
+    internal->response_complete = 0;
+    internal->chunk_state = HTTP_CHUNK_SIZE;
+    internal->chunk_remaining = 0;
+    internal->chunk_read_pos = 0;
+    internal->body_size = 0;
     
     return internal;
     }
 
 
+static void http_internal_get_header( http_internal_t* internal, char const* protocol, char const* resource, 
+    char const* address, char const* port, char const* headers )
+    {
+    if( !headers ) headers = "";
+    char* request_header;   
+    size_t request_header_len = 64 + strlen( resource ) + strlen( address ) + strlen( port ) + strlen( headers );
+    if( request_header_len < sizeof( internal->request_header ) )
+        {
+        internal->request_header_large = NULL;
+        request_header = internal->request_header;
+        }
+    else
+        {
+        internal->request_header_large = (char*) HTTP_MALLOC( internal->memctx, request_header_len + 1 );
+        request_header = internal->request_header_large;
+        }       
+    sprintf( request_header, "GET %s %s\r\nHost: %s:%s\r\n%s\r\n", resource, protocol, address, port, headers );
+    }
+
+
 http_t* http_get( char const* url, void* memctx )
+    {
+    return http_get_headers( url, NULL, memctx );
+    }
+
+
+http_t* http_get_headers( char const* url, char const* headers, void* memctx )
     {       
     #ifdef _WIN32
         WSADATA wsa_data;
@@ -408,19 +604,7 @@ http_t* http_get( char const* url, void* memctx )
     http_internal_t* internal = http_internal_create( 0, memctx );
     internal->socket = socket;
 
-    char* request_header;   
-    size_t request_header_len = 64 + strlen( resource ) + strlen( address ) + strlen( port );
-    if( request_header_len < sizeof( internal->request_header ) )
-        {
-        internal->request_header_large = NULL;
-        request_header = internal->request_header;
-        }
-    else
-        {
-        internal->request_header_large = (char*) HTTP_MALLOC( memctx, request_header_len + 1 );
-        request_header = internal->request_header_large;
-        }       
-    sprintf( request_header, "GET %s HTTP/1.0\r\nHost: %s:%s\r\n\r\n", resource, address, port );
+    http_internal_get_header( internal, "HTTP/1.0", resource, address, port, headers );
     
     return &internal->http;
     }
@@ -469,28 +653,398 @@ http_t* http_post( char const* url, void const* data, size_t size, void* memctx
     }
 
 
+http_pool_t* http_pool_create( void* memctx )
+    {
+    http_pool_t* pool = (http_pool_t*) HTTP_MALLOC( memctx, sizeof( http_pool_t ) );
+    if( !pool ) return NULL;
+    pool->memctx = memctx;
+    pool->hosts = NULL;
+    return pool;
+    }
+
+
+void http_pool_destroy( http_pool_t* pool )
+    {
+    http_pool_host_t* host = pool->hosts;
+    while( host )
+        {
+        http_pool_host_t* next = host->next;
+        for( int i = 0; i < host->idle_count; ++i ) http_internal_close( host->idle[ i ] );
+        HTTP_FREE( pool->memctx, host );
+        host = next;
+        }
+    HTTP_FREE( pool->memctx, pool );
+    }
+
+
+static http_pool_host_t* http_internal_pool_host( http_pool_t* pool, char const* address, char const* port )
+    {
+    for( http_pool_host_t* host = pool->hosts; host; host = host->next )
+        if( strcmp( host->address, address ) == 0 && strcmp( host->port, port ) == 0 ) return host;
+
+    http_pool_host_t* host = (http_pool_host_t*) HTTP_MALLOC( pool->memctx, sizeof( http_pool_host_t ) );
+    if( !host ) return NULL;
+    strcpy( host->address, address );
+    strcpy( host->port, port );
+    host->resolved = 0;
+    host->idle_count = 0;
+    host->next = pool->hosts;
+    pool->hosts = host;
+    return host;
+    }
+
+
+// an idle connection is still usable if the server hasn't closed it, nor sent anything
+static int http_internal_pool_alive( HTTP_SOCKET socket )
+    {
+    char c;
+    return recv( socket, &c, 1, MSG_PEEK ) == -1 && http_internal_would_block();
+    }
+
+
+static HTTP_SOCKET http_internal_pool_connect( http_pool_host_t* host, int* reused )
+    {
+    time_t now = time( NULL );
+
+    // the most recently used connections first, they're the least likely to have been closed
+    while( host->idle_count > 0 )
+        {
+        --host->idle_count;
+        HTTP_SOCKET socket = host->idle[ host->idle_count ];
+        if( now - host->idle_time[ host->idle_count ] < HTTP_POOL_IDLE_TIMEOUT && http_internal_pool_alive( socket ) )
+            {
+            *reused = 1;
+            return socket;
+            }
+        http_internal_close( socket );
+        }
+
+    *reused = 0;
+    if( !host->resolved || now - host->resolved_time >= HTTP_POOL_DNS_TTL )
+        {
+        struct addrinfo* addri = http_internal_resolve( host->address, host->port );
+        if( !addri ) return HTTP_INVALID_SOCKET;
+        memcpy( &host->addr, addri->ai_addr, addri->ai_addrlen );
+        host->addr_len = (socklen_t) addri->ai_addrlen;
+        host->resolved = 1;
+        host->resolved_time = now;
+        freeaddrinfo( addri );
+        }
+    HTTP_SOCKET socket = http_internal_connect_addr( (struct sockaddr const*) &host->addr, host->addr_len );
+    // the address may have changed
+    if( socket == HTTP_INVALID_SOCKET ) host->resolved = 0;
+    return socket;
+    }
+
+
+http_t* http_get_pooled( http_pool_t* pool, char const* url, char const* headers, void* memctx )
+    {       
+    #ifdef _WIN32
+        WSADATA wsa_data;
+        if( WSAStartup( MAKEWORD( 1, 0 ), &wsa_data ) != 0 ) return NULL;
+    #endif
+    
+    char address[ 256 ];
+    char port[ 16 ];
+    char const* resource;
+    
+    if( http_internal_parse_url( url, address, sizeof( address ), port, sizeof( port ), &resource ) == 0 )
+        return NULL; 
+
+    http_pool_host_t* host = http_internal_pool_host( pool, address, port );
+    if( !host ) return NULL;
+
+    int reused = 0;
+    HTTP_SOCKET socket = http_internal_pool_connect( host, &reused );
+    if( socket == HTTP_INVALID_SOCKET ) return NULL;
+    
+    http_internal_t* internal = http_internal_create( 0, memctx );
+    internal->socket = socket;
+    internal->pool_host = host;
+    internal->connect_pending = !reused;
+
+    http_internal_get_header( internal, "HTTP/1.1", resource, address, port, headers );
+    
+    return &internal->http;
+    }
+
+
+// http_internal_find_header() returns the value of the header field name (case insensitive) in the response header, 
+// or NULL
+static char const* http_internal_find_header( char const* header, char const* name )
+    {
+    size_t name_len = strlen( name );
+    char const* line = strstr( header, "\r\n" );
+    while( line && line[ 2 ] != '\r' )
+        {
+        line += 2;
+        #ifdef _WIN32
+            int match = _strnicmp( line, name, name_len ) == 0;
+        #else
+            int match = strncasecmp( line, name, name_len ) == 0;
+        #endif
+        if( match && line[ name_len ] == ':' )
+            {
+            char const* value = line + name_len + 1;
+            while( *value == ' ' || *value == '\t' ) ++value;
+            return value;
+            }
+        line = strstr( line, "\r\n" );
+        }
+    return NULL;
+    }
+
+
+// http_internal_has_token() tells if the header field value (up to the end of its line) has the token, as in 
+// "Connection: close" or "Transfer-Encoding: chunked"
+static int http_internal_has_token( char const* value, char const* token )
+    {
+    size_t token_len = strlen( token );
+    char const* value_end = strstr( value, "\r\n" );
+    while( value && value < value_end )
+        {
+        #ifdef _WIN32
+            int match = _strnicmp( value, token, token_len ) == 0;
+        #else
+            int match = strncasecmp( value, token, token_len ) == 0;
+        #endif
+        if( match && ( value + token_len == value_end || value[ token_len ] == ',' || value[ token_len ] == ' ' 
+            || value[ token_len ] == ';' ) )
+            return 1;
+        value = strchr( value, ',' );
+        if( value ) while( *value == ',' || *value == ' ' ) ++value;
+        }
+    return 0;
+    }
+
+
+// http_internal_parse_header() reads the status line and the header fields of the response, once the whole header has 
+// been received
+static int http_internal_parse_header( http_internal_t* internal )
+    {
+    http_t* http = &internal->http;
+    char const* status_line = (char const*) internal->data;
+
+    int http_11 = strncmp( status_line, "HTTP/1.1 ", 9 ) == 0;
+
+    // skip http version
+    status_line = strchr( status_line, ' ' );
+    if( !status_line ) return 0;
+    ++status_line;
+    
+    // extract status code
+    char status_code[ 16 ];
+    char const* status_code_end = strchr( status_line, ' ' );
+    if( !status_code_end || status_code_end - status_line >= (int) sizeof( status_code ) ) return 0;
+    memcpy( status_code, status_line, (size_t)( status_code_end - status_line ) );
+    status_code[ status_code_end - status_line ] = 0;
+    status_line = status_code_end + 1;
+    http->status_code = atoi( status_code );
+    
+    // extract reason phrase
+    char const* reason_phrase_end = strstr( status_line, "\r\n" );
+    if( !reason_phrase_end ) return 0;
+    size_t reason_phrase_len = (size_t)( reason_phrase_end - status_line );
+    if( reason_phrase_len >= sizeof( internal->reason_phrase ) ) 
+        reason_phrase_len = sizeof( internal->reason_phrase ) - 1;
+    memcpy( internal->reason_phrase, status_line, reason_phrase_len );
+    internal->reason_phrase[ reason_phrase_len ] = 0;
+    
+    // extract content type
+    char const* content_type_start = http_internal_find_header( (char const*) internal->data, "Content-Type" );
+    if( content_type_start )
+        {
+        char const* content_type_end = strstr( content_type_start, "\r\n" );
+        size_t content_type_len = (size_t)( content_type_end - content_type_start );
+        if( content_type_len >= sizeof( internal->content_type ) ) 
+            content_type_len = sizeof( internal->content_type ) - 1;
+        memcpy( internal->content_type, content_type_start, content_type_len );
+        internal->content_type[ content_type_len ] = 0;
+        }
+
+    // HTTP/1.1 connections are persistent unless told otherwise, HTTP/1.0 ones the other way around
+    char const* connection = http_internal_find_header( (char const*) internal->data, "Connection" );
+    internal->keep_alive = connection ? 
+        ( http_11 ? !http_internal_has_token( connection, "close" ) : http_internal_has_token( connection, "keep-alive" ) )
+        : http_11;
+
+    // find out where the body ends
+    char const* transfer_encoding = http_internal_find_header( (char const*) internal->data, "Transfer-Encoding" );
+    char const* content_length = http_internal_find_header( (char const*) internal->data, "Content-Length" );
+    if( http->status_code / 100 == 1 || http->status_code == 204 || http->status_code == 304 )
+        {
+        internal->framing = HTTP_FRAMING_LENGTH;
+        internal->content_length = 0;
+        }
+    else if( transfer_encoding && http_internal_has_token( transfer_encoding, "chunked" ) )
+        {
+        internal->framing = HTTP_FRAMING_CHUNKED;
+        internal->chunk_read_pos = internal->header_size;
+        }
+    else if( content_length )
+        {
+        char* end;
+        unsigned long long length = strtoull( content_length, &end, 10 );
+        if( end == content_length || ( *end != '\r' && *end != ' ' ) ) return 0;
+        internal->framing = HTTP_FRAMING_LENGTH;
+        internal->content_length = (size_t) length;
+        }
+    else
+        {
+        internal->framing = HTTP_FRAMING_CLOSE;
+        internal->keep_alive = 0;
+        }
+    return 1;
+    }
+
+
+// http_internal_reserve() makes room for size more bytes of response, plus the zero terminator, moving what has been 
+// received so far to a larger buffer if needed: only the first bytes of the body, for a response with a Content-Length
+static int http_internal_reserve( http_internal_t* internal, size_t size )
+    {
+    if( size > ( (size_t) -1 ) / 2 - internal->data_size ) return 0;
+    size_t min_capacity = internal->data_size + size + 1;
+    if( internal->data_capacity >= min_capacity ) return 1;
+
+    void* new_data = HTTP_MALLOC( internal->memctx, min_capacity );
+    if( !new_data ) return 0;
+    memcpy( new_data, internal->data, internal->data_size );
+    HTTP_FREE( internal->memctx, internal->data );
+    internal->data = new_data;
+    internal->data_capacity = min_capacity;
+    return 1;
+    }
+
+
+// http_internal_dechunk() decodes the chunks received so far, moving their data right after the header. Returns 1 once 
+// the last chunk has been received, 0 if more data is needed, -1 if the chunks are not valid.
+static int http_internal_dechunk( http_internal_t* internal )
+    {
+    char* data = (char*) internal->data;
+    for( ;; )
+        {
+        size_t available = internal->data_size - internal->chunk_read_pos;
+        char* read = data + internal->chunk_read_pos;
+        if( internal->chunk_state == HTTP_CHUNK_DATA )
+            {
+            size_t size = available < internal->chunk_remaining ? available : internal->chunk_remaining;
+            memmove( data + internal->header_size + internal->body_size, read, size );
+            internal->body_size += size;
+            internal->chunk_read_pos += size;
+            internal->chunk_remaining -= size;
+            if( internal->chunk_remaining > 0 ) return 0;
+            internal->chunk_state = HTTP_CHUNK_DATA_END;
+            }
+        else if( internal->chunk_state == HTTP_CHUNK_DATA_END )
+            {
+            if( available < 2 ) return 0;
+            if( read[ 0 ] != '\r' || read[ 1 ] != '\n' ) return -1;
+            internal->chunk_read_pos += 2;
+            internal->chunk_state = HTTP_CHUNK_SIZE;
+            }
+        else
+            {
+            char* line_end = (char*) memchr( read, '\n', available );
+            if( !line_end ) return available > 1024 ? -1 : 0;
+            internal->chunk_read_pos += (size_t)( line_end + 1 - read );
+            if( internal->chunk_state == HTTP_CHUNK_TRAILER )
+                {
+                // an empty line ends the trailer
+                if( line_end == read || ( line_end == read + 1 && read[ 0 ] == '\r' ) ) return 1;
+                continue;
+                }
+            char* size_end;
+            unsigned long long size = strtoull( read, &size_end, 16 );
+            if( size_end == read ) return -1;
+            internal->chunk_remaining = (size_t) size;
+            internal->chunk_state = size ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+            }
+        }
+    }
+
+
+// http_internal_complete() checks if the whole response has been received, and sets it up if it has
+static int http_internal_complete( http_internal_t* internal, int closed )
+    {
+    http_t* http = &internal->http;
+    size_t received = internal->data_size - internal->header_size;
+
+    if( internal->framing == HTTP_FRAMING_LENGTH )
+        {
+        if( received < internal->content_length ) 
+            {
+            if( closed ) http->status = HTTP_STATUS_FAILED;
+            return closed;
+            }
+        // nothing is expected after the response: don't use the connection again if there's more
+        if( received > internal->content_length ) internal->keep_alive = 0;
+        internal->body_size = internal->content_length;
+        }
+    else if( internal->framing == HTTP_FRAMING_CHUNKED )
+        {
+        int result = http_internal_dechunk( internal );
+        if( result == 0 )
+            {
+            if( closed ) http->status = HTTP_STATUS_FAILED;
+            return closed;
+            }
+        if( result < 0 )
+            {
+            http->status = HTTP_STATUS_FAILED;
+            return 1;
+            }
+        if( internal->chunk_read_pos < internal->data_size ) internal->keep_alive = 0;
+        }
+    else
+        {
+        if( !closed ) return 0;
+        internal->body_size = received;
+        }
+
+    internal->response_complete = 1;
+    if( closed ) internal->keep_alive = 0;
+    http->status =  http->status_code < 300 ? HTTP_STATUS_COMPLETED : HTTP_STATUS_FAILED;
+    http->response_data = (void*)( ( (uintptr_t) internal->data ) + internal->header_size );
+    http->response_size = internal->body_size;
+
+    // add an extra zero after the received data, but don't modify the size, so ascii results can be used as
+    // a zero terminated string. the size returned will be the string without this extra zero terminator.
+    ( (char*)http->response_data )[ http->response_size ] = 0;
+    return 1;
+    }
+
+
 http_status_t http_process( http_t* http )
     {
     http_internal_t* internal = (http_internal_t*) http;    
     
-    if( http->status == HTTP_STATUS_FAILED ) return http->status;
+    if( http->status != HTTP_STATUS_PENDING ) return http->status;
     
     if( internal->connect_pending )
         {   
-        fd_set sockets_to_check; 
-        FD_ZERO( &sockets_to_check );
-        #pragma warning( push )
-        #pragma warning( disable: 4548 ) // expression before comma has no effect; expected expression with side-effect
-        FD_SET( internal->socket, &sockets_to_check );
-        #pragma warning( pop )
-        struct timeval timeout; timeout.tv_sec = 0; timeout.tv_usec = 0;
+        struct pollfd socket_to_check;
+        socket_to_check.fd = internal->socket;
+        socket_to_check.events = POLLOUT;
+        socket_to_check.revents = 0;
         // check if socket is ready for send
-        if( select( (int)( internal->socket + 1 ), NULL, &sockets_to_check, NULL, &timeout ) == 1 ) 
+        #ifdef _WIN32
+            int ready = WSAPoll( &socket_to_check, 1, 0 );
+        #else
+            int ready = poll( &socket_to_check, 1, 0 );
+        #endif
+        if( ready == 1 ) 
             {
             int opt = -1;
             socklen_t len = sizeof( opt ); 
             if( getsockopt( internal->socket, SOL_SOCKET, SO_ERROR, (char*)( &opt ), &len) >= 0 && opt == 0 ) 
                 internal->connect_pending = 0; // if it is, we're connected
+            else
+                {
+                // the connection was refused or could not be established, maybe the address changed
+                if( internal->pool_host ) internal->pool_host->resolved = 0;
+                http->status = HTTP_STATUS_FAILED;
+                return http->status;
+                }
             }
         }
 
@@ -518,134 +1072,90 @@ http_status_t http_process( http_t* http )
         return http->status;
         }
 
-    // check if socket is ready for recv
-    fd_set sockets_to_check; 
-    FD_ZERO( &sockets_to_check );
-    #pragma warning( push )
-    #pragma warning( disable: 4548 ) // expression before comma has no effect; expected expression with side-effect
-    FD_SET( internal->socket, &sockets_to_check );
-    #pragma warning( pop )
-    struct timeval timeout; timeout.tv_sec = 0; timeout.tv_usec = 0;
-    while( select( (int)( internal->socket + 1 ), &sockets_to_check, NULL, NULL, &timeout ) == 1 )
+    // receive all the data available, until the end of the response, straight into the response buffer
+    for( ;; )
         {
-        char buffer[ 4096 ];
-        int size = recv( internal->socket, buffer, sizeof( buffer ), 0 );
-        if( size == -1 )
+        size_t room;
+        if( internal->header_size && internal->framing == HTTP_FRAMING_LENGTH )
             {
-            http->status = HTTP_STATUS_FAILED;
-            return http->status;
-            }
-        else if( size > 0 )
-            {
-            size_t min_size = internal->data_size + size + 1;
-            if( internal->data_capacity < min_size )
+            // exactly the rest of the body, nothing of a following response
+            room = internal->header_size + internal->content_length - internal->data_size;
+            if( !http_internal_reserve( internal, room ) )
                 {
-                internal->data_capacity *= 2; 
-                if( internal->data_capacity < min_size ) internal->data_capacity = min_size;
-                void* new_data = HTTP_MALLOC( memctx, internal->data_capacity );
-                memcpy( new_data, internal->data, internal->data_size );
-                HTTP_FREE( memctx, internal->data );
-                internal->data = new_data;
+                http->status = HTTP_STATUS_FAILED;
+                return http->status;
                 }
-            memcpy( (void*)( ( (uintptr_t) internal->data ) + internal->data_size ), buffer, (size_t) size );
-            internal->data_size += size;
             }
-        else if( size == 0 )
+        else
             {
-            char const* status_line = (char const*) internal->data;
-
-            int header_size = 0;
-            char const* header_end = strstr( status_line, "\r\n\r\n" );
-            if( header_end )
-                {
-                header_end += 4;
-                header_size = (int)( header_end - status_line );
-                }
-            else
+            if( internal->data_capacity - internal->data_size - 1 < HTTP_RECV_SIZE && 
+                !http_internal_reserve( internal, internal->data_capacity ) )
                 {
                 http->status = HTTP_STATUS_FAILED;
                 return http->status;
                 }
+            room = internal->data_capacity - internal->data_size - 1;
+            }
 
-            // skip http version
-            status_line = strchr( status_line, ' ' );
-            if( !status_line )
-                {
-                http->status = HTTP_STATUS_FAILED;
-                return http->status;
-                }
-            ++status_line;
-            
-            // extract status code
-            char status_code[ 16 ];
-            char const* status_code_end = strchr( status_line, ' ' );
-            if( !status_code_end )
+        int size = (int) recv( internal->socket, (char*) internal->data + internal->data_size, 
+            (int)( room < INT_MAX ? room : INT_MAX ), 0 );
+        if( size == -1 )
+            {
+            if( !http_internal_would_block() ) http->status = HTTP_STATUS_FAILED;
+            return http->status;
+            }
+        internal->data_size += size;
+        // so that the header can be searched as a string
+        ( (char*) internal->data )[ internal->data_size ] = 0;
+
+        if( !internal->header_size )
+            {
+            char const* header_end = strstr( (char const*) internal->data, "\r\n\r\n" );
+            if( header_end )
                 {
-                http->status = HTTP_STATUS_FAILED;
-                return http->status;
+                internal->header_size = (size_t)( header_end + 4 - (char const*) internal->data );
+                if( !http_internal_parse_header( internal ) )
+                    {
+                    http->status = HTTP_STATUS_FAILED;
+                    return http->status;
+                    }
                 }
-            memcpy( status_code, status_line, (size_t)( status_code_end - status_line ) );
-            status_code[ status_code_end - status_line ] = 0;
-            status_line = status_code_end + 1;
-            http->status_code = atoi( status_code );
-            
-            // extract reason phrase
-            char const* reason_phrase_end = strstr( status_line, "\r\n" );
-            if( !reason_phrase_end )
+            else if( size == 0 )
                 {
                 http->status = HTTP_STATUS_FAILED;
                 return http->status;
                 }
-            size_t reason_phrase_len = (size_t)( reason_phrase_end - status_line );
-            if( reason_phrase_len >= sizeof( internal->reason_phrase ) ) 
-                reason_phrase_len = sizeof( internal->reason_phrase ) - 1;
-            memcpy( internal->reason_phrase, status_line, reason_phrase_len );
-            internal->reason_phrase[ reason_phrase_len ] = 0;
-            status_line = reason_phrase_end + 1;
-            
-            // extract content type
-            char const* content_type_start = strstr( status_line, "Content-Type: " );
-            if( content_type_start )
-                {
-                content_type_start += strlen( "Content-Type: " );
-                char const* content_type_end = strstr( content_type_start, "\r\n" );
-                if( content_type_end )
-                    {
-                    size_t content_type_len = (size_t)( content_type_end - content_type_start );
-                    if( content_type_len >= sizeof( internal->content_type ) ) 
-                        content_type_len = sizeof( internal->content_type ) - 1;
-                    memcpy( internal->content_type, content_type_start, content_type_len );
-                    internal->content_type[ content_type_len ] = 0;
-                    }
-                }
-
-            http->status =  http->status_code < 300 ? HTTP_STATUS_COMPLETED : HTTP_STATUS_FAILED;
-            http->response_data = (void*)( ( (uintptr_t) internal->data ) + header_size );
-            http->response_size = internal->data_size - header_size;
-
-            // add an extra zero after the received data, but don't modify the size, so ascii results can be used as
-            // a zero terminated string. the size returned will be the string without this extra zero terminator.
-            ( (char*)http->response_data )[ http->response_size ] = 0;
-            return http->status;
             }
+
+        if( internal->header_size && http_internal_complete( internal, size == 0 ) ) return http->status;
         }
-    
-    return http->status;
+    }
+
+
+int http_socket( http_t* http )
+    {
+    http_internal_t* internal = (http_internal_t*) http;
+    return (int) internal->socket;
     }
 
 
 void http_release( http_t* http )
     {
     http_internal_t* internal = (http_internal_t*) http;
-    #ifdef _WIN32
-        closesocket( internal->socket );
-    #else
-        close( internal->socket );
-    #endif
+    http_pool_host_t* host = internal->pool_host;
+    // back to the pool if the server can take another request on it
+    if( host && internal->response_complete && internal->keep_alive && host->idle_count < HTTP_POOL_MAX_IDLE )
+        {
+        host->idle[ host->idle_count ] = internal->socket;
+        host->idle_time[ host->idle_count ] = time( NULL );
+        ++host->idle_count;
+        }
+    else
+        http_internal_close( internal->socket );
 
-    if( internal->request_header_large) HTTP_FREE( memctx, internal->request_header_large );
-    HTTP_FREE( memctx, internal->data );
-    HTTP_FREE( memctx, internal );
+    if( internal->request_header_large) HTTP_FREE( internal->memctx, internal->request_header_large );
+    HTTP_FREE( internal->memctx, internal->data );
+    HTTP_FREE( internal->memctx, internal );
     #ifdef _WIN32
         WSACleanup();
     #endif
@@ -656,6 +1166,8 @@ void http_release( http_t* http )
 
 /*
 revision history:
+    1.2     responses received straight into a buffer sized from their Content-Length
+    1.1     responses delimited by Content-Length or chunked encoding, pool of keep-alive connections
     1.0     first released version  
 */
 
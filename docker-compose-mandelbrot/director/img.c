@@ -1,7 +1,16 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+// here, so that stbi_write_png_to_mem() and STBIW_FREE are the ones of the
+// implementation
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
 
 #include "img.h"
 
@@ -11,33 +20,164 @@
 
 #define MAX_BUF_SIZE 64
 
+#define IMAGE_ALIGN 64				// of the pixels and of the strides
+#define IMAGE_HEADER_SIZE 64			// image_block_t, padded to IMAGE_ALIGN
+#define IMAGE_MIN_BLOCK_SIZE 4096
+#define IMAGE_HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+#define IMAGE_POOL_MAX_BUFFERS 16
+#define IMAGE_POOL_MAX_SIZE ((size_t)256 * 1024 * 1024)
+
+/* --------------------------------------------------------------------
+ *   TYPES
+ * -------------------------------------------------------------------- */
+
+// the memory of an image from image_new(): this header, then the pixels
+typedef struct image_block {
+	struct image_block *next;		// in the pool
+	size_t size;				// of the whole block
+	img_t img;
+} image_block_t;
+
+/* --------------------------------------------------------------------
+ *   GLOBALS
+ * -------------------------------------------------------------------- */
+
+// blocks released by image_destroy(), most recent first, reused by
+// image_new() so that every image doesn't cost a fresh mmap and page faults
+static pthread_mutex_t image_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static image_block_t *image_pool;
+static int image_pool_buffers;
+static size_t image_pool_size;
+
 /* --------------------------------------------------------------------
  *   CODE
  * -------------------------------------------------------------------- */
 
+// image_block_size() rounds size up to its bucket: a multiple of a quarter
+// of its power of two, so that at most a fifth is wasted, and of the huge
+// page size for the large ones
+static size_t image_block_size(size_t size)
+{
+	size_t step = IMAGE_MIN_BLOCK_SIZE;
+	while (step * 8 < size)
+		step *= 2;
+	size = (size + step - 1) / step * step;
+	if (size >= IMAGE_HUGE_PAGE_SIZE)
+		size = (size + IMAGE_HUGE_PAGE_SIZE - 1) / IMAGE_HUGE_PAGE_SIZE * IMAGE_HUGE_PAGE_SIZE;
+	return size;
+}
+
+// image_pool_get() takes a block of the given size from the pool, if any
+static image_block_t *image_pool_get(size_t size)
+{
+	pthread_mutex_lock(&image_pool_lock);
+	image_block_t **link = &image_pool;
+	while (*link && (*link)->size != size)
+		link = &(*link)->next;
+	image_block_t *block = *link;
+	if (block) {
+		*link = block->next;
+		image_pool_buffers--;
+		image_pool_size -= size;
+	}
+	pthread_mutex_unlock(&image_pool_lock);
+	return block;
+}
+
+static image_block_t *image_block_alloc(size_t size)
+{
+	void *block = NULL;
+	// the large ones on huge page boundaries, to be backed by huge pages
+	size_t align = size >= IMAGE_HUGE_PAGE_SIZE ? IMAGE_HUGE_PAGE_SIZE : IMAGE_ALIGN;
+	if (posix_memalign(&block, align, size) != 0)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	if (size >= IMAGE_HUGE_PAGE_SIZE)
+		madvise(block, size, MADV_HUGEPAGE);	// just a hint, it may fail
+#endif
+	((image_block_t *)block)->size = size;
+	return (image_block_t *)block;
+}
+
+// image_new() allocates a width x height image, with its pixels left
+// uninitialized: they must all be written, or cleared with image_fill().
+// The rows are aligned to 64 bytes, and the stride may be larger than the
+// pixels of a row.
 img_t *image_new(int width, int height)
 {
-	size_t data_size = (size_t)((size_t)width * (size_t)height * (size_t)3L);
-	img_t *img_and_data = (img_t *) malloc(sizeof(img_t) + data_size);
-	if (!img_and_data)
+	size_t stride = ((size_t)3 * (size_t)width + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+	size_t size = image_block_size(IMAGE_HEADER_SIZE + stride * (size_t)height);
+
+	image_block_t *block = image_pool_get(size);
+	if (!block)
+		block = image_block_alloc(size);
+	if (!block)
 		return NULL;
-	img_and_data->width = width;
-	img_and_data->height = height;
-	img_and_data->data = ((uint8_t*)img_and_data) + sizeof(img_t);
-	return img_and_data;
+	block->img.width = width;
+	block->img.height = height;
+	block->img.stride = stride;
+	block->img.data = (uint8_t *)block + IMAGE_HEADER_SIZE;
+	return &block->img;
 }
 
+// image_destroy() releases an image from image_new() (not a view), keeping
+// its memory in a pool for the next images of the same size, up to 16
+// images and 256 MB
 void image_destroy(img_t *img)
 {
 	if (!img)
 		return;
-	memset(img, 0, sizeof(img_t));
-	free(img);
+	image_block_t *block = (image_block_t *)((uint8_t *)img - offsetof(image_block_t, img));
+
+	pthread_mutex_lock(&image_pool_lock);
+	if (image_pool_buffers < IMAGE_POOL_MAX_BUFFERS && image_pool_size + block->size <= IMAGE_POOL_MAX_SIZE) {
+		block->next = image_pool;
+		image_pool = block;
+		image_pool_buffers++;
+		image_pool_size += block->size;
+		block = NULL;
+	}
+	pthread_mutex_unlock(&image_pool_lock);
+	free(block);
+}
+
+// image_view() makes view refer to the width x height rectangle of img at
+// (x0, y0), clipped to img, sharing its pixels; returns 0 if nothing is left
+// after clipping. Views of views are fine, views must not outlive img.
+int image_view(img_t *view, img_t *img, int x0, int y0, int width, int height)
+{
+	if (x0 < 0) {
+		width += x0;
+		x0 = 0;
+	}
+	if (y0 < 0) {
+		height += y0;
+		y0 = 0;
+	}
+	if (width > img->width - x0)
+		width = img->width - x0;
+	if (height > img->height - y0)
+		height = img->height - y0;
+	if (width <= 0 || height <= 0) {
+		memset(view, 0, sizeof(img_t));
+		return 0;
+	}
+	view->width = width;
+	view->height = height;
+	view->stride = img->stride;
+	view->data = img->data + (size_t)y0 * img->stride + (size_t)3 * (size_t)x0;
+	return 1;
+}
+
+// image_row() returns the first pixel of row y
+uint8_t *image_row(img_t *img, int y)
+{
+	return img->data + (size_t)y * img->stride;
 }
 
 void image_set_pixel(img_t *img, int x, int y, uint8_t r, uint8_t g, uint8_t b)
 {
-	size_t base_offs = (size_t)3L * ((size_t)y * (size_t)img->width + (size_t)x);
+	size_t base_offs = (size_t)y * img->stride + (size_t)3L * (size_t)x;
 	img->data[base_offs + 0] = r;
 	img->data[base_offs + 1] = g;
 	img->data[base_offs + 2] = b;
@@ -45,7 +185,7 @@ void image_set_pixel(img_t *img, int x, int y, uint8_t r, uint8_t g, uint8_t b)
 
 void image_get_pixel(img_t *img, int x, int y, uint8_t *r, uint8_t *g, uint8_t *b)
 {
-	size_t base_offs = (size_t)3L * ((size_t)y * (size_t)img->width + (size_t)x);
+	size_t base_offs = (size_t)y * img->stride + (size_t)3L * (size_t)x;
 	if (r)
 		*r = img->data[base_offs + 0];
 	if (g)
@@ -54,66 +194,168 @@ void image_get_pixel(img_t *img, int x, int y, uint8_t *r, uint8_t *g, uint8_t *
 		*b = img->data[base_offs + 2];
 }
 
+// image_fill() sets every pixel of img to (r, g, b): with a memset if the
+// three bytes are equal, otherwise by filling the first row with copies of
+// itself of doubling size, then copying it to the others
 void image_fill(img_t *img, uint8_t r, uint8_t g, uint8_t b)
 {
-	for (int y = 0; y < img->height; y++) {
-		for (int x = 0; x < img->width; x++) {
-			size_t base_offs = (size_t)3L * ((size_t)y * (size_t)img->width + (size_t)x);
-			img->data[base_offs + 0] = r;
-			img->data[base_offs + 1] = g;
-			img->data[base_offs + 2] = b;
+	if (img->width <= 0 || img->height <= 0)
+		return;
+	size_t row_size = (size_t)3 * (size_t)img->width;
+
+	if (r == g && g == b) {
+		if (row_size == img->stride) {
+			memset(img->data, r, row_size * (size_t)img->height);
+			return;
 		}
+		for (int y = 0; y < img->height; y++)
+			memset(image_row(img, y), r, row_size);
+		return;
 	}
+
+	uint8_t *row = img->data;
+	row[0] = r;
+	row[1] = g;
+	row[2] = b;
+	for (size_t filled = 3; filled < row_size; filled *= 2)
+		memcpy(row + filled, row, filled < row_size - filled ? filled : row_size - filled);
+	for (int y = 1; y < img->height; y++)
+		memcpy(image_row(img, y), row, row_size);
 }
 
+// image_blit() copies the dst_w x dst_h rectangle of src at (src_x0, src_y0)
+// to (dst_x0, dst_y0) in dst, clipped to both images, one row at a time; the
+// two rectangles must not overlap
 void image_blit(img_t *dst, img_t *src, int dst_x0, int dst_y0, int dst_w, int dst_h, int src_x0, int src_y0)
 {
-	if (dst_x0 < 0) dst_x0 = 0;
-	if (dst_x0 < 0) dst_x0 = 0;
-	if (dst_x0 >= (dst->width - 1))
-		dst_x0 = dst->width - 1;
-	if (dst_y0 >= (dst->height - 1))
-		dst_y0 = dst->height - 1;
-
-	int dst_x1 = dst_x0 + dst_w - 1;
-	int dst_y1 = dst_y0 + dst_h - 1;
-	if (dst_x1 >= (dst->width - 1))
-		dst_x1 = dst->width - 1;
-	if (dst_y1 >= (dst->height - 1))
-		dst_y1 = dst->height - 1;
-
-	if (src_x0 < 0) src_x0 = 0;
-	if (src_y0 < 0) src_y0 = 0;
-	if (src_x0 >= (src->width - 1))
-		src_x0 = src->width - 1;
-	if (src_y0 >= (src->height - 1))
-		src_y0 = src->height - 1;
-
-	for (int dst_y = dst_y0; dst_y <= dst_y1; dst_y++) {
-		int src_y = dst_y + (src_y0 - dst_y0);
-		if (src_y < 0) src_y = 0;
-		if (src_y >= (src->height - 1))
-			src_y = src->height - 1;
-		for (int dst_x = dst_x0; dst_x <= dst_x1; dst_x++) {
-			int src_x = dst_x + (src_x0 - dst_x0);
-			if (src_x < 0) src_x = 0;
-			if (src_x >= (src->width - 1))
-				src_x = src->width - 1;
-
-			uint8_t r, g, b;
-			image_get_pixel(src, src_x, src_y, &r, &g, &b);
-			image_set_pixel(dst, dst_x, dst_y, r, g, b);
-		}
+	// the parts out of either image are cut off, on the other one as well
+	if (dst_x0 < 0) {
+		src_x0 -= dst_x0;
+		dst_w += dst_x0;
+		dst_x0 = 0;
+	}
+	if (dst_y0 < 0) {
+		src_y0 -= dst_y0;
+		dst_h += dst_y0;
+		dst_y0 = 0;
+	}
+	if (src_x0 < 0) {
+		dst_x0 -= src_x0;
+		dst_w += src_x0;
+		src_x0 = 0;
+	}
+	if (src_y0 < 0) {
+		dst_y0 -= src_y0;
+		dst_h += src_y0;
+		src_y0 = 0;
+	}
+	if (dst_w > dst->width - dst_x0)
+		dst_w = dst->width - dst_x0;
+	if (dst_w > src->width - src_x0)
+		dst_w = src->width - src_x0;
+	if (dst_h > dst->height - dst_y0)
+		dst_h = dst->height - dst_y0;
+	if (dst_h > src->height - src_y0)
+		dst_h = src->height - src_y0;
+	if (dst_w <= 0 || dst_h <= 0)
+		return;
+
+	size_t dst_stride = image_stride_size(dst);
+	size_t src_stride = image_stride_size(src);
+	size_t row_size = (size_t)3 * (size_t)dst_w;
+	uint8_t *dst_row = dst->data + (size_t)dst_y0 * dst_stride + (size_t)3 * (size_t)dst_x0;
+	const uint8_t *src_row = src->data + (size_t)src_y0 * src_stride + (size_t)3 * (size_t)src_x0;
+
+	// whole rows of both: a single copy
+	if (row_size == dst_stride && row_size == src_stride) {
+		memcpy(dst_row, src_row, row_size * (size_t)dst_h);
+		return;
+	}
+	for (int y = 0; y < dst_h; y++) {
+		memcpy(dst_row, src_row, row_size);
+		dst_row += dst_stride;
+		src_row += src_stride;
+	}
+}
+
+// image_palette_new() returns the grey palette of the renderers, from white
+// for the points escaping at once to black for the ones in the set, computed
+// once instead of for every pixel; free it with image_palette_destroy()
+img_palette_t *image_palette_new(int max_iter)
+{
+	if (max_iter < 1)
+		return NULL;
+	img_palette_t *palette = (img_palette_t *)malloc(sizeof(img_palette_t) + (size_t)(max_iter + 1) * 3);
+	if (!palette)
+		return NULL;
+	palette->max_iter = max_iter;
+	for (int n = 0; n <= max_iter; n++) {
+		int color = 255 - (int)((double)n * 255.0 / (double)max_iter);
+		palette->rgb[n][0] = palette->rgb[n][1] = palette->rgb[n][2] = (uint8_t)color;
 	}
+	return palette;
 }
 
+void image_palette_destroy(img_palette_t *palette)
+{
+	free(palette);
+}
+
+// image_colorize_row() colours row y of img with the iteration counts in
+// iters, one per pixel; counts past max_iter get the colour of max_iter
+void image_colorize_row(img_t *img, int y, const uint16_t *iters, const img_palette_t *palette)
+{
+	uint8_t *row = image_row(img, y);
+	unsigned max_iter = (unsigned)palette->max_iter;
+	for (int x = 0; x < img->width; x++) {
+		unsigned n = iters[x] < max_iter ? iters[x] : max_iter;
+		row[3 * x + 0] = palette->rgb[n][0];
+		row[3 * x + 1] = palette->rgb[n][1];
+		row[3 * x + 2] = palette->rgb[n][2];
+	}
+}
 
 size_t image_stride_size(img_t *img)
 {
-	return ((size_t)3 * (size_t)img->width);
+	return img->stride;
 }
 
+// image_data_size() returns the bytes spanned by the pixels of img, from the
+// first one to the last one
 size_t image_data_size(img_t *img)
 {
-	return ((size_t)3 * (size_t)img->width * (size_t)img->height);
+	if (img->height <= 0)
+		return 0;
+	return ((size_t)(img->height - 1) * img->stride + (size_t)3 * (size_t)img->width);
+}
+
+// image_encode_png() encodes img as PNG into buf (which must be zeroed or
+// previously freed): buf->data is stb's own buffer, handed over without
+// copying it, and must be released with image_buf_free() or image_png_free();
+// returns 0 on failure
+int image_encode_png(img_t *img, img_buf_t *buf)
+{
+	int len = 0;
+	uint8_t *data = stbi_write_png_to_mem(img->data, (int)image_stride_size(img), img->width, img->height, 3, &len);
+	if (!data)
+		return 0;
+	buf->data = data;
+	buf->size = (size_t)len;
+	buf->capacity = (size_t)len;
+	return 1;
+}
+
+// image_png_free() releases an encoded PNG as stb would, so that it can be
+// given as the release function of http_response_body_owned()
+void image_png_free(void *data)
+{
+	STBIW_FREE(data);
+}
+
+void image_buf_free(img_buf_t *buf)
+{
+	if (!buf)
+		return;
+	image_png_free(buf->data);
+	memset(buf, 0, sizeof(img_buf_t));
 }
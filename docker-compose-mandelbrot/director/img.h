@@ -8,27 +8,54 @@
  *   MACROS AND CONSTANTS
  * -------------------------------------------------------------------- */
 
+// the palette made by image_palette_new(), e.g. for the keys of stored tiles
+#define IMAGE_PALETTE_GREY 0
+
 /* --------------------------------------------------------------------
  *   TYPES
  * -------------------------------------------------------------------- */
 
+// an image, or a view of a rectangle of another image (see image_view()):
+// row y starts at data + y * stride, with 3 bytes (r, g, b) per pixel
 typedef struct image {
 	int width;
 	int height;
+	size_t stride;		// bytes from a row to the next one
 	uint8_t *data;
 } img_t;
 
+// colours of the iteration counts from 0 to max_iter, see image_palette_new()
+typedef struct image_palette {
+	int max_iter;
+	uint8_t rgb[][3];
+} img_palette_t;
+
+// in-memory buffer, e.g. for an encoded PNG
+typedef struct image_buf {
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+} img_buf_t;
+
 /* --------------------------------------------------------------------
  *   PROTOTYPES
  * -------------------------------------------------------------------- */
 
 img_t *image_new(int width, int height);
 void image_destroy(img_t *img);
+int image_view(img_t *view, img_t *img, int x0, int y0, int width, int height);
+uint8_t *image_row(img_t *img, int y);
 void image_set_pixel(img_t *img, int x, int y, uint8_t r, uint8_t g, uint8_t b);
 void image_get_pixel(img_t *img, int x, int y, uint8_t *r, uint8_t *g, uint8_t *b);
 void image_fill(img_t *img, uint8_t r, uint8_t g, uint8_t b);
 void image_blit(img_t *dst, img_t *src, int dst_x0, int dst_y0, int dst_w, int dst_h, int src_x0, int src_y0);
+img_palette_t *image_palette_new(int max_iter);
+void image_palette_destroy(img_palette_t *palette);
+void image_colorize_row(img_t *img, int y, const uint16_t *iters, const img_palette_t *palette);
 size_t image_stride_size(img_t *img);
 size_t image_data_size(img_t *img);
+int image_encode_png(img_t *img, img_buf_t *buf);
+void image_buf_free(img_buf_t *buf);
+void image_png_free(void *data);
 
 #endif /* IMG_H */
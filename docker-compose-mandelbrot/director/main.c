@@ -1,11 +1,18 @@
 #define _GNU_SOURCE
 #include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <math.h>
 #include <unistd.h>
 #include <signal.h>
-#include <sys/stat.h>
+#include <errno.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
 
 #define HTTP_IMPLEMENTATION
 #include "http.h"
@@ -15,25 +22,70 @@
 #define HTTPSERVER_IMPL
 #include "httpserver.h"
 
+#define MANDEL_IMPLEMENTATION
+#include "mandel.h"
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+#define CACHE_IMPLEMENTATION
+#include "cache.h"
+
+#define TILE_IMPLEMENTATION
+#include "tile.h"
+
+#define STORE_IMPLEMENTATION
+#include "store.h"
+
+#define FLIGHT_IMPLEMENTATION
+#include "flight.h"
 
 #include "img.h"
+#include "iter.h"
 
 #define DEFAULT_PORT 9000
+#define DEFAULT_CACHE_MB 64
+#define DEFAULT_TILE_STORE_MB 256
 
-#define MAX_WORKERS 100
+// the workers are read from the file WORKERS_FILE, or from WORKERS, as a
+// list of host[:port] (see hosts_load()), again on SIGHUP; by default they're
+// worker0 ... worker8
 #define DEFAULT_WORKER_BASE_NAME "worker"
+#define DEFAULT_WORKER_PORT "8000"
 #ifdef LOCAL_USE
-    #define DEFAULT_NWORKER_H 1
-    #define DEFAULT_NWORKER_V 1
+    #define DEFAULT_NWORKERS 1
 #else
-    #define DEFAULT_NWORKER_H 3
-    #define DEFAULT_NWORKER_V 3
+    #define DEFAULT_NWORKERS 9
 #endif
+#define MAX_HOST_NAME 128
+
+// the image is cut in about PARTS_PER_WORKER parts for each worker alive,
+// with at least PART_MIN_SIZE pixels per side and up to MAX_PARTS_SIDE x
+// MAX_PARTS_SIDE of them, queued until a worker is free: each worker renders
+// up to PARTS_IN_FLIGHT parts at once and takes the next one as soon as it's
+// done with one, so that the faster workers render more of them (see
+// parts_dispatch())
+#define PARTS_PER_WORKER 8
+#define PART_MIN_SIZE 48
+#define MAX_PARTS_SIDE 16
+#define PARTS_IN_FLIGHT 2
+
+// a part of the image is asked to a second worker if the first one is too
+// slow, and to other workers if it fails, up to MAX_RETRIES times, waiting
+// RETRY_BACKOFF_MS ms before the first retry and twice as much before each
+// following one; then the director renders it itself (see hedge_tick_cb())
+#define MAX_RETRIES 3
+#define MAX_ATTEMPTS (2 + MAX_RETRIES)
+#define HEDGE_TICK_MS 5
+#define HEDGE_MIN_MS 20.0
+#define RETRY_BACKOFF_MS 10.0
+// a worker failing is left out for EJECT_MS ms, twice as long for each
+// failure in a row, up to EJECT_MAX_MS
+#define EJECT_MS 1000.0
+#define EJECT_MAX_MS 30000.0
+
+// as the workers, for the parts rendered here
+#define MAX_ITER 100
 
 #ifndef TRUE
 #define FALSE ((int)0)
@@ -49,15 +101,109 @@ typedef struct mandelbrot_region {
 	int height;
 } mandelbrot_region_t;
 
-typedef struct worker {
-    int worker_no;
+typedef struct job job_t;
+typedef struct part part_t;
+typedef struct host host_t;
+
+// a request to a worker for its part of the image
+typedef struct attempt {
+    // called by the server loop when the worker socket is ready, keep it
+    // first (see http_server_loop())
+    void (*handler)(struct epoll_event *ev);
+    part_t *part;
+    host_t *host;
+    http_t *request;
+    double t_start;
+} attempt_t;
+
+// a part of a job, rendered by a worker
+struct part {
+    job_t *job;
+    part_t *queue_next;
+    host_t *host;           // the one which rendered it
     int row;
     int column;
+    int x;                  // position in the image
+    int y;
     mandelbrot_region_t region;
-    http_t *request;
     http_status_t status;
     int received;
-} worker_t;
+    int hedged;
+    int n_failures;
+    double retry_at;        // when to retry, if not 0
+    int n_attempts;
+    attempt_t attempt[MAX_ATTEMPTS];
+};
+
+// a worker, and the latency of the requests to it, in ms per megapixel
+struct host {
+    char name[MAX_HOST_NAME];   // host:port
+    int removed;            // from the list, freed once idle
+    double latency;
+    double deviation;
+    int samples;
+    int in_flight;
+    int failures;           // in a row
+    double ejected_until;
+};
+
+typedef struct hedge_timer {
+    // keep it first, as in attempt_t
+    void (*handler)(struct epoll_event *ev);
+    int fd;
+    int armed;
+} hedge_timer_t;
+
+typedef struct reload_signal {
+    // keep it first, as in attempt_t
+    void (*handler)(struct epoll_event *ev);
+    int fd;
+} reload_signal_t;
+
+// a client request, being rendered by the workers
+struct job {
+    job_t *prev;
+    job_t *next;
+    struct http_request_s *srv_request;
+    mandelbrot_region_t region;
+    img_t *img;
+    int nparts;
+    int n_pending;
+    int n_failed;
+    int n_completed;
+    double t_start;
+    // identical requests wait for the job with the same key (see flight.h);
+    // tiles are also kept in the cache (and in the store) once rendered
+    cache_key_t key;
+    int cache_result;
+    store_key_t store_key;
+    // the iterations the parts were rendered with, as reported by the
+    // workers: 0 while none is known, -1 if unknown or not the same for all
+    int max_iter;
+    part_t part[];
+};
+
+struct http_server_s *server = NULL;
+cache_t *cache = NULL;
+store_t *store = NULL;
+flights_t *flights = NULL;
+// keep-alive connections to the workers, used by the server loop only
+http_pool_t *pool = NULL;
+
+host_t **hosts = NULL;
+int nhosts = 0;
+hedge_timer_t hedge_timer;
+reload_signal_t reload_signal;
+// the jobs being rendered, and the finished ones not yet freed (see
+// hedge_tick_cb())
+job_t *jobs = NULL;
+job_t *finished_jobs = NULL;
+job_t *retired_jobs = NULL;
+// the parts waiting for a worker, oldest first
+part_t *queue_head = NULL;
+part_t *queue_tail = NULL;
+// the colours of the iteration counts, for the max_iter of the last part
+img_palette_t *palette = NULL;
 
 
 /*
@@ -65,12 +211,14 @@ typedef struct worker {
  *   - https://simple.wikipedia.org/wiki/Mandelbrot_set
  *
  * compile:
- *   $ gcc -std=c99 -Wall -o worker main.c img.c -lm
+ *   $ gcc -std=c99 -Wall -o director main.c img.c iter.c -lm
  *
  * run:
- *   $ ./worker
+ *   $ ./director
  *
  * and visit: http://127.0.0.1:8000/600/400/-2/-1/1/1
+ *
+ * or ask for 256x256 tiles (see tile.h): http://127.0.0.1:8000/tile/2/1/1.png
  */
 
 // time_ms() returns the number of ms since epoch (1 jan 1970)
@@ -84,10 +232,657 @@ double time_ms(void)
 #define OOM_RESPONSE "out of memory"
 #define NOT_FOUND "not found"
 #define INTERNAL_ERROR_RESPONSE "internal error"
-#define PATHNAME_LEN 240
+#define BAD_REQUEST_RESPONSE "bad image size"
 #define MAX_URL_SIZE 240
+// as mandelbrot-http-server: so that no body outgrows the int length of
+// http_response_body_owned()
+#define MAX_IMAGE_PIXELS (64 * 1024 * 1024)
+#define MAX_WORKER_URL_SIZE (MAX_HOST_NAME + MAX_URL_SIZE)
+
+// ask the workers for raw iteration counts, so that colorization and PNG
+// encoding happen only once, here; PNG is still accepted as a fallback
+#define WORKER_REQUEST_HEADERS "Accept: " ITER_CONTENT_TYPE ", image/png\r\n"
+
+int merge_part_image(img_t *dst, part_t *part, http_t *worker_request);
+int render_part_locally(img_t *dst, part_t *part);
+void hedge_timer_arm(int armed);
+
+// job_response() builds the response for a request that joined the job:
+// each one needs its own reference to the cached image, or its own copy
+struct http_response_s *job_response(int encoded, const img_buf_t *png, const uint8_t *cached) {
+    struct http_response_s* response = http_response_init();
+    if (!encoded) {
+        http_response_status(response, 500);
+        http_response_header(response, "Content-Type", "text/plain");
+        http_response_body(response, INTERNAL_ERROR_RESPONSE, sizeof(INTERNAL_ERROR_RESPONSE) - 1);
+        return response;
+    }
+    http_response_status(response, 200);
+    http_response_header(response, "Content-Type", "image/png");
+    if (cached) {
+        cache_retain(cached);
+        http_response_body_owned(response, (const char *)cached, (int)png->size, cache_release);
+    } else {
+        // copied by http_respond_async()
+        http_response_body(response, (const char *)png->data, (int)png->size);
+    }
+    return response;
+}
+
+// job_finish() sends the merged image to the client, and to the identical
+// requests that joined the job, and frees the job once every worker has
+// completed or failed
+void job_finish(job_t *job) {
+    struct http_response_s* response = http_response_init();
+
+    fprintf(stderr, "finishing handler work (%lg ms)...\n", time_ms() - job->t_start);
 
-int merge_worker_image(img_t *dst, mandelbrot_region_t *dst_region, worker_t *worker);
+    img_buf_t png;
+    memset(&png, 0, sizeof(png));
+    // a PNG too large for the int length of the response is a failure
+    int encoded = image_encode_png(job->img, &png) && png.size <= INT_MAX;
+    image_destroy(job->img);
+    const uint8_t *cached = NULL;
+    if (encoded) {
+        // keyed on the iterations the workers actually used
+        job->store_key.max_iter = job->max_iter;
+        if (store && job->cache_result && job->max_iter > 0 && !store_put(store, &job->store_key, png.data, png.size)) {
+            fprintf(stderr, "can't write the tile to the store\n");
+        }
+        if (job->cache_result) {
+            cached = cache_put(cache, &job->key, png.data, png.size);
+        }
+    }
+
+    struct http_request_s *waiter = flight_leave(flights, &job->key, sizeof(job->key));
+    while (waiter) {
+        struct http_request_s *next = (struct http_request_s *)http_request_userdata(waiter);
+        http_respond_async(waiter, job_response(encoded, &png, cached));
+        waiter = next;
+    }
+
+    if (!encoded) {
+        image_buf_free(&png);
+        http_response_status(response, 500);
+        http_response_header(response, "Content-Type", "text/plain");
+        http_response_body(response, INTERNAL_ERROR_RESPONSE, sizeof(INTERNAL_ERROR_RESPONSE) - 1);
+    } else {
+        size_t size = png.size;
+        http_response_status(response, 200);
+        http_response_header(response, "Content-Type", "image/png");
+        // freed by the server once sent
+        if (cached) {
+            image_buf_free(&png);
+            http_response_body_owned(response, (const char *)cached, (int)size, cache_release);
+        } else {
+            http_response_body_owned(response, (const char *)png.data, (int)size, image_png_free);
+        }
+    }
+    // not called from the request handler: see http_respond_async()
+    http_respond_async(job->srv_request, response);
+
+    // the server loop may still have events for its worker requests, it's
+    // freed later by hedge_tick_cb()
+    if (job->prev)
+        job->prev->next = job->next;
+    else
+        jobs = job->next;
+    if (job->next)
+        job->next->prev = job->prev;
+    job->next = finished_jobs;
+    finished_jobs = job;
+    hedge_timer_arm(TRUE);
+}
+
+double part_mpixels(part_t *part) {
+    return (double)part->region.width * (double)part->region.height / 1e6;
+}
+
+// host_sample() updates the latency estimate of a worker as TCP does for the
+// round trip time (RFC 6298)
+void host_sample(host_t *host, double ms, double mpixels) {
+    double sample = ms / (mpixels > 0 ? mpixels : 1e-6);
+
+    if (host->samples == 0) {
+        host->latency = sample;
+        host->deviation = sample / 2;
+    } else {
+        host->deviation += (fabs(sample - host->latency) - host->deviation) / 4;
+        host->latency += (sample - host->latency) / 8;
+    }
+    host->samples++;
+}
+
+void host_failed(host_t *host) {
+    double eject_ms = EJECT_MS;
+
+    for (int i = 0; i < host->failures && eject_ms < EJECT_MAX_MS; i++)
+        eject_ms *= 2;
+    if (eject_ms > EJECT_MAX_MS)
+        eject_ms = EJECT_MAX_MS;
+    host->failures++;
+    host->ejected_until = time_ms() + eject_ms;
+    fprintf(stderr, "worker %s ejected for %lg ms\n", host->name, eject_ms);
+}
+
+// host_find() returns the worker named name in the current list, or NULL
+host_t *host_find(const char *name) {
+    for (int i = 0; i < nhosts; i++) {
+        if (strcmp(hosts[i]->name, name) == 0)
+            return hosts[i];
+    }
+    return NULL;
+}
+
+// hosts_add() appends the worker name (host:port) to list, unless it's
+// already there, reusing the one in the current list if any
+int hosts_add(host_t ***list, int *n, int *size, const char *name) {
+    for (int i = 0; i < *n; i++) {
+        if (strcmp((*list)[i]->name, name) == 0)
+            return TRUE;
+    }
+    if (*n == *size) {
+        int new_size = *size ? *size * 2 : 16;
+        host_t **new_list = (host_t **)realloc(*list, (size_t)new_size * sizeof(host_t *));
+        if (!new_list)
+            return FALSE;
+        *list = new_list;
+        *size = new_size;
+    }
+    host_t *host = host_find(name);
+    if (!host) {
+        host = (host_t *)calloc(1, sizeof(host_t));
+        if (!host)
+            return FALSE;
+        snprintf(host->name, sizeof(host->name), "%s", name);
+    }
+    (*list)[(*n)++] = host;
+    return TRUE;
+}
+
+// hosts_add_entry() appends the workers of an entry of the configuration:
+// host:port, or host for port DEFAULT_WORKER_PORT, or @host[:port] for all
+// the IPv4 addresses of host, as a docker compose service scaled to several
+// containers. Invalid entries are skipped; returns FALSE if out of memory.
+int hosts_add_entry(host_t ***list, int *n, int *size, const char *entry) {
+    char port[16] = DEFAULT_WORKER_PORT;
+    char host[MAX_HOST_NAME - sizeof(port)];
+    char name[MAX_HOST_NAME];
+    int expand = (entry[0] == '@');
+    const char *host_start = expand ? entry + 1 : entry;
+    const char *colon = strrchr(host_start, ':');
+    size_t host_len = colon ? (size_t)(colon - host_start) : strlen(host_start);
+
+    if (host_len == 0 || host_len >= sizeof(host) ||
+            (colon && (colon[1] == '\0' || strlen(colon + 1) >= sizeof(port)))) {
+        fprintf(stderr, "invalid worker '%s'\n", entry);
+        return TRUE;
+    }
+    memcpy(host, host_start, host_len);
+    host[host_len] = '\0';
+    if (colon)
+        strcpy(port, colon + 1);
+
+    if (!expand) {
+        snprintf(name, sizeof(name), "%s:%s", host, port);
+        return hosts_add(list, n, size, name);
+    }
+
+    struct addrinfo hints;
+    struct addrinfo *addrs;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(host, NULL, &hints, &addrs);
+    if (error) {
+        fprintf(stderr, "can't resolve worker '%s': %s\n", host, gai_strerror(error));
+        return TRUE;
+    }
+    int ok = TRUE;
+    for (struct addrinfo *addr = addrs; addr && ok; addr = addr->ai_next) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &((struct sockaddr_in *)addr->ai_addr)->sin_addr, ip, sizeof(ip));
+        snprintf(name, sizeof(name), "%s:%s", ip, port);
+        ok = hosts_add(list, n, size, name);
+    }
+    freeaddrinfo(addrs);
+    return ok;
+}
+
+// hosts_config() returns the configured list of workers, to be freed
+char *hosts_config(void) {
+    const char *path = getenv("WORKERS_FILE");
+    const char *workers = getenv("WORKERS");
+
+    if (path && (strcmp(path, "") != 0)) {
+        FILE *f = fopen(path, "r");
+        if (!f) {
+            fprintf(stderr, "can't open the workers file %s: %s\n", path, strerror(errno));
+            return NULL;
+        }
+        char *config = NULL;
+        long size = -1;
+        if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0)
+            config = (char *)malloc((size_t)size + 1);
+        if (config) {
+            size = (long)fread(config, 1, (size_t)size, f);
+            config[size] = '\0';
+        }
+        fclose(f);
+        return config;
+    }
+    if (workers && (strcmp(workers, "") != 0))
+        return strdup(workers);
+
+#ifdef LOCAL_USE
+    return strdup("127.0.0.1:" DEFAULT_WORKER_PORT);
+#else
+    char *config = (char *)malloc(DEFAULT_NWORKERS * 32);
+    if (!config)
+        return NULL;
+    config[0] = '\0';
+    for (int i = 0; i < DEFAULT_NWORKERS; i++)
+        sprintf(config + strlen(config), "%s%d ", DEFAULT_WORKER_BASE_NAME, i);
+    return config;
+#endif
+}
+
+// hosts_load() reads the list of workers from the file WORKERS_FILE, or from
+// WORKERS, separated by commas or spaces, with # starting a comment up to the
+// end of the line (see hosts_add_entry()). The workers already in the list
+// keep their latency estimates, the ones no longer there are freed once
+// idle. Returns FALSE, keeping the current list, if the new one can't be read
+// or is empty.
+int hosts_load(void) {
+    char *config = hosts_config();
+    host_t **list = NULL;
+    int n = 0, size = 0;
+    int ok = (config != NULL);
+
+    char *line_ptr = NULL;
+    for (char *line = ok ? strtok_r(config, "\n", &line_ptr) : NULL; line && ok; line = strtok_r(NULL, "\n", &line_ptr)) {
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+        char *entry_ptr = NULL;
+        for (char *entry = strtok_r(line, " \t\r,", &entry_ptr); entry && ok; entry = strtok_r(NULL, " \t\r,", &entry_ptr))
+            ok = hosts_add_entry(&list, &n, &size, entry);
+    }
+    free(config);
+    if (!ok || n == 0) {
+        fprintf(stderr, "can't load the workers, keeping the %d current ones\n", nhosts);
+        for (int i = 0; i < n; i++) {
+            if (!host_find(list[i]->name))
+                free(list[i]);
+        }
+        free(list);
+        return FALSE;
+    }
+
+    for (int i = 0; i < nhosts; i++) {
+        host_t *host = hosts[i];
+        int kept = FALSE;
+        for (int j = 0; j < n && !kept; j++)
+            kept = (list[j] == host);
+        if (kept)
+            continue;
+        if (host->in_flight == 0) {
+            fprintf(stderr, "worker %s removed\n", host->name);
+            free(host);
+        } else {
+            host->removed = TRUE;
+        }
+    }
+    free(hosts);
+    hosts = list;
+    nhosts = n;
+    for (int i = 0; i < nhosts; i++)
+        fprintf(stderr, "worker %s\n", hosts[i]->name);
+    return TRUE;
+}
+
+// pick_worker() returns the best worker to ask part to, among the ones not
+// ejected nor already working on it, with less than max_in_flight requests
+// in flight, or NULL
+host_t *pick_worker(part_t *part, int max_in_flight) {
+    double now = time_ms();
+    host_t *best = NULL;
+
+    for (int i = 0; i < nhosts; i++) {
+        host_t *host = hosts[i];
+        if (host->ejected_until > now || host->in_flight >= max_in_flight)
+            continue;
+        int busy = FALSE;
+        for (int j = 0; j < part->n_attempts; j++) {
+            if (part->attempt[j].request && part->attempt[j].host == host)
+                busy = TRUE;
+        }
+        if (busy)
+            continue;
+        if (!best || host->in_flight < best->in_flight ||
+                (host->in_flight == best->in_flight && host->latency < best->latency))
+            best = host;
+    }
+    return best;
+}
+
+// hosts_alive() returns the number of workers not ejected
+int hosts_alive(void) {
+    double now = time_ms();
+    int alive = 0;
+
+    for (int i = 0; i < nhosts; i++) {
+        if (hosts[i]->ejected_until <= now)
+            alive++;
+    }
+    return alive;
+}
+
+// hedge_deadline() returns after how many ms a request for mpixels
+// megapixels is considered late, and asked to another worker too, or -1 if
+// the latency of the workers is not known yet. As TCP's retransmission
+// timeout it's the average latency plus 4 deviations, so that only around 1%
+// of the requests get hedged; the estimates of all the workers are used, as
+// the slow one would give itself more time.
+double hedge_deadline(double mpixels) {
+    double latency = 0, deviation = 0;
+    int n = 0;
+
+    for (int i = 0; i < nhosts; i++) {
+        if (hosts[i]->samples > 0) {
+            latency += hosts[i]->latency;
+            deviation += hosts[i]->deviation;
+            n++;
+        }
+    }
+    if (n == 0)
+        return -1;
+    double deadline = (latency + 4 * deviation) / n * mpixels;
+    return deadline > HEDGE_MIN_MS ? deadline : HEDGE_MIN_MS;
+}
+
+void attempt_io_cb(struct epoll_event *ev);
+
+// attempt_start() sends the request for part of the image to the worker
+// host
+int attempt_start(part_t *part, host_t *host) {
+    mandelbrot_region_t *part_region = &(part->region);
+    char url[MAX_WORKER_URL_SIZE + 1];
+
+    snprintf(url, sizeof(url), "http://%s/%d/%d/%.17g/%.17g/%.17g/%.17g", host->name,
+        part_region->width, part_region->height,
+        part_region->c_start_re, part_region->c_start_im,
+        part_region->c_end_re, part_region->c_end_im);
+    fprintf(stderr, "making request to url %s\n", url);
+    http_t *request = http_get_pooled(pool, url, WORKER_REQUEST_HEADERS, NULL);
+    if (!request) {
+        fprintf(stderr, "Invalid request for worker %s (part %dx%d)\n", host->name, part->column, part->row);
+        return FALSE;
+    }
+
+    attempt_t *attempt = &part->attempt[part->n_attempts++];
+    attempt->handler = attempt_io_cb;
+    attempt->part = part;
+    attempt->host = host;
+    attempt->request = request;
+    attempt->t_start = time_ms();
+    host->in_flight++;
+
+    // let the server loop tell us when there's something to do
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = attempt;
+    epoll_ctl(http_server_loop(server), EPOLL_CTL_ADD, http_socket(request), &ev);
+    return TRUE;
+}
+
+void attempt_end(attempt_t *attempt) {
+    epoll_ctl(http_server_loop(server), EPOLL_CTL_DEL, http_socket(attempt->request), NULL);
+    http_release(attempt->request);
+    attempt->request = NULL;
+    // the last request to a worker no longer in the list
+    if (--attempt->host->in_flight == 0 && attempt->host->removed) {
+        fprintf(stderr, "worker %s removed\n", attempt->host->name);
+        free(attempt->host);
+    }
+}
+
+void part_done(part_t *part, http_status_t status) {
+    job_t *job = part->job;
+
+    part->status = status;
+    if (status == HTTP_STATUS_FAILED)
+        job->n_failed++;
+    else
+        job->n_completed++;
+    job->n_pending--;
+    fprintf(stderr, "pending/failed/completed: %d/%d/%d\n", job->n_pending, job->n_failed, job->n_completed);
+    if (job->n_pending == 0) {
+        job_finish(job);
+    }
+}
+
+// part_failed() is called when no request for part is left: it's retried
+// later by hedge_tick_cb(), or rendered here as a last resort, blocking the
+// loop for a while but sparing the client an image with a hole
+void part_failed(part_t *part) {
+    if (part->n_failures < MAX_RETRIES && part->n_attempts < MAX_ATTEMPTS) {
+        double backoff = RETRY_BACKOFF_MS;
+        for (int i = 0; i < part->n_failures; i++)
+            backoff *= 2;
+        part->n_failures++;
+        part->retry_at = time_ms() + backoff;
+        fprintf(stderr, "part %dx%d: retrying in %lg ms\n", part->column, part->row, backoff);
+        return;
+    }
+    fprintf(stderr, "part %dx%d: rendering locally\n", part->column, part->row);
+    if (render_part_locally(part->job->img, part)) {
+        part_done(part, HTTP_STATUS_COMPLETED);
+    } else {
+        // a white hole, rather than whatever was in memory
+        img_t view;
+        if (image_view(&view, part->job->img, part->x, part->y, part->region.width, part->region.height))
+            image_fill(&view, 255, 255, 255);
+        part_done(part, HTTP_STATUS_FAILED);
+    }
+}
+
+// part_queue() puts part in the queue of the parts waiting for a worker, at
+// the end, or at the beginning if it's being retried
+void part_queue(part_t *part, int retry) {
+    part->queue_next = NULL;
+    if (!queue_head) {
+        queue_head = queue_tail = part;
+    } else if (retry) {
+        part->queue_next = queue_head;
+        queue_head = part;
+    } else {
+        queue_tail->queue_next = part;
+        queue_tail = part;
+    }
+}
+
+// parts_dispatch() hands the queued parts to the workers with less than
+// PARTS_IN_FLIGHT parts in flight, the fastest first; it's called whenever a
+// worker may have become free
+void parts_dispatch(void) {
+    while (queue_head) {
+        part_t *part = queue_head;
+        host_t *host = pick_worker(part, PARTS_IN_FLIGHT);
+        if (!host) {
+            // all busy, the next one done takes it
+            if (pick_worker(part, INT_MAX))
+                return;
+            fprintf(stderr, "part %dx%d: no worker available\n", part->column, part->row);
+        }
+        queue_head = part->queue_next;
+        if (!queue_head)
+            queue_tail = NULL;
+        if (!host) {
+            part_failed(part);
+        } else if (!attempt_start(part, host)) {
+            host_failed(host);
+            part_failed(part);
+        }
+    }
+}
+
+// attempt_io_cb() is called by the server loop whenever the socket of a
+// worker request is ready
+void attempt_io_cb(struct epoll_event *ev) {
+    attempt_t *attempt = (attempt_t *)ev->data.ptr;
+    part_t *part = attempt->part;
+    job_t *job = part->job;
+    http_t *request = attempt->request;
+
+    // cancelled, while the event was waiting
+    if (!request)
+        return;
+
+    http_status_t status = http_process(request);
+    if (status == HTTP_STATUS_PENDING)
+        return;
+
+    double elapsed = time_ms() - attempt->t_start;
+    host_t *host = attempt->host;
+    if (status == HTTP_STATUS_FAILED) {
+        fprintf(stderr, "worker %s status:FAILED  [%d] %s\n", host->name, (int)request->status_code, request->reason_phrase);
+    } else {
+        fprintf(stderr, "worker %s status:COMPLETED  received:%d (%lg ms)\n", host->name, (int)request->response_size, elapsed);
+        part->host = host;
+        if (merge_part_image(job->img, part, request)) {
+            host_sample(host, elapsed, part_mpixels(part));
+            host->failures = 0;
+        } else {
+            fprintf(stderr, "worker %s merge FAILED\n", host->name);
+            status = HTTP_STATUS_FAILED;
+        }
+    }
+    if (status == HTTP_STATUS_FAILED)
+        host_failed(host);
+    // may free host
+    attempt_end(attempt);
+
+    int pending = FALSE;
+    for (int i = 0; i < part->n_attempts; i++) {
+        attempt_t *other = &part->attempt[i];
+        if (!other->request)
+            continue;
+        if (status == HTTP_STATUS_FAILED) {
+            pending = TRUE;
+            continue;
+        }
+        // the slower request is cancelled; the time it took so far is a lower
+        // bound of the latency of its worker
+        double other_elapsed = time_ms() - other->t_start;
+        double other_latency = other_elapsed / part_mpixels(part);
+        if (other->host->samples == 0 || other_latency > other->host->latency)
+            host_sample(other->host, other_elapsed, part_mpixels(part));
+        fprintf(stderr, "worker %s cancelled after %lg ms\n", other->host->name, other_elapsed);
+        attempt_end(other);
+    }
+
+    if (status == HTTP_STATUS_COMPLETED)
+        part_done(part, status);
+    else if (!pending)
+        part_failed(part);
+    parts_dispatch();
+}
+
+// hedge_part() asks part to the fastest idle worker as well, if there's any
+void hedge_part(part_t *part, attempt_t *late) {
+    host_t *best = pick_worker(part, 1);
+    if (!best)
+        return;
+    fprintf(stderr, "worker %s is late, hedging with worker %s\n", late->host->name, best->name);
+    if (attempt_start(part, best))
+        part->hedged = TRUE;
+    else
+        host_failed(best);
+}
+
+// hedge_tick_cb() is called by the server loop every HEDGE_TICK_MS ms while
+// there are jobs, to retry the failed worker requests and hedge the late
+// ones, and to free the jobs finished before the previous tick: their events
+// are surely gone by now
+void hedge_tick_cb(struct epoll_event *ev) {
+    (void)ev;
+    uint64_t expirations;
+    if (read(hedge_timer.fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    while (retired_jobs) {
+        job_t *job = retired_jobs;
+        retired_jobs = job->next;
+        free(job);
+    }
+    retired_jobs = finished_jobs;
+    finished_jobs = NULL;
+
+    double now = time_ms();
+    job_t *next;
+    for (job_t *job = jobs; job; job = next) {
+        // the job may finish, and leave the list, on a retry
+        next = job->next;
+        for (int i = 0; i < job->nparts && job->n_pending > 0; i++) {
+            part_t *part = &job->part[i];
+            if (part->status != HTTP_STATUS_PENDING)
+                continue;
+            if (part->retry_at > 0) {
+                if (now >= part->retry_at) {
+                    part->retry_at = 0;
+                    part_queue(part, TRUE);
+                }
+                continue;
+            }
+
+            attempt_t *late = NULL;
+            int in_flight = 0;
+            for (int j = 0; j < part->n_attempts; j++) {
+                if (part->attempt[j].request) {
+                    late = &part->attempt[j];
+                    in_flight++;
+                }
+            }
+            if (part->hedged || in_flight != 1 || part->n_attempts >= MAX_ATTEMPTS)
+                continue;
+            double deadline = hedge_deadline(part_mpixels(part));
+            if (deadline >= 0 && now - late->t_start > deadline)
+                hedge_part(part, late);
+        }
+    }
+    // retried parts, and ejected workers back in
+    parts_dispatch();
+
+    if (!jobs && !retired_jobs)
+        hedge_timer_arm(FALSE);
+}
+
+void hedge_timer_arm(int armed) {
+    if (hedge_timer.armed == armed)
+        return;
+    struct itimerspec ts;
+    memset(&ts, 0, sizeof(ts));
+    if (armed) {
+        ts.it_value.tv_nsec = HEDGE_TICK_MS * 1000000L;
+        ts.it_interval.tv_nsec = HEDGE_TICK_MS * 1000000L;
+    }
+    timerfd_settime(hedge_timer.fd, 0, &ts, NULL);
+    hedge_timer.armed = armed;
+}
+
+// reload_signal_cb() is called by the server loop on SIGHUP, to read the
+// list of workers again
+void reload_signal_cb(struct epoll_event *ev) {
+    (void)ev;
+    struct signalfd_siginfo info;
+    while (read(reload_signal.fd, &info, sizeof(info)) == sizeof(info))
+        ;
+    fprintf(stderr, "reloading the workers...\n");
+    hosts_load();
+    // the new ones can take the queued parts
+    parts_dispatch();
+}
 
 void handle_request(struct http_request_s* srv_request) {
     http_string_t url = http_request_target(srv_request);
@@ -101,174 +896,146 @@ void handle_request(struct http_request_s* srv_request) {
 
     mandelbrot_region_t region;
     memset(&region, 0, sizeof(region));
-    if (sscanf(url.buf, "/%d/%d/%lg/%lg/%lg/%lg",
+    int nparts_h, nparts_v;
+    tile_t tile;
+    cache_key_t key;
+    store_key_t store_key;
+    int is_tile = tile_parse(url.buf, (size_t)url.len, &tile);
+    if (is_tile) {
+        region.width = region.height = TILE_SIZE;
+        region.c_start_re = tile.c_start_re;
+        region.c_start_im = tile.c_start_im;
+        region.c_end_re = tile.c_end_re;
+        region.c_end_im = tile.c_end_im;
+        // the number of iterations is up to the workers
+        cache_key_init(&key, TILE_SIZE, TILE_SIZE, 0,
+            region.c_start_re, region.c_start_im, region.c_end_re, region.c_end_im);
+
+        size_t size;
+        const uint8_t *cached = cache_get(cache, &key, &size);
+        if (cached) {
+            fprintf(stderr, "cache hit, png size:%zu\n", size);
+            http_response_status(response, 200);
+            http_response_header(response, "Content-Type", "image/png");
+            http_response_body_owned(response, (const char *)cached, (int)size, cache_release);
+            http_respond(srv_request, response);
+            return;
+        }
+        // what the workers render with now: tiles stored with a different
+        // max_iter (e.g. before a deploy) are not served
+        store_key_init(&store_key, tile.z, tile.x, tile.y, MAX_ITER, IMAGE_PALETTE_GREY);
+        cached = store ? store_get(store, &store_key, &size) : NULL;
+        if (cached) {
+            fprintf(stderr, "store hit, png size:%zu\n", size);
+            http_response_status(response, 200);
+            http_response_header(response, "Content-Type", "image/png");
+            http_response_body_owned(response, (const char *)cached, (int)size, store_release);
+            http_respond(srv_request, response);
+            return;
+        }
+        // a tile is small enough to be a single part: a viewer asks for
+        // several at once anyway
+        nparts_h = nparts_v = 1;
+    } else if (sscanf(url.buf, "/%d/%d/%lg/%lg/%lg/%lg",
             &region.width, &region.height,
             &region.c_start_re, &region.c_start_im,
             &region.c_end_re, &region.c_end_im) != 6) {
         goto not_found;
     }
     fprintf(stderr, "%d x %d (%lg,%lg)-(%lg,%lg)\n", region.width, region.height, region.c_start_re, region.c_start_im, region.c_end_re, region.c_end_im);
+    if (region.width <= 0 || region.height <= 0 || (int64_t)region.width * (int64_t)region.height > MAX_IMAGE_PIXELS) {
+        goto bad_request;
+    }
+    if (!is_tile) {
+        // square parts, as many as needed to keep the workers alive busy
+        int alive = hosts_alive();
+        double side = sqrt((double)region.width * (double)region.height / (double)(PARTS_PER_WORKER * (alive > 0 ? alive : 1)));
+        if (side < PART_MIN_SIZE)
+            side = PART_MIN_SIZE;
+        nparts_h = (int)((double)region.width / side + 0.5);
+        nparts_h = nparts_h < 1 ? 1 : (nparts_h > MAX_PARTS_SIDE ? MAX_PARTS_SIDE : nparts_h);
+        nparts_v = (int)((double)region.height / side + 0.5);
+        nparts_v = nparts_v < 1 ? 1 : (nparts_v > MAX_PARTS_SIDE ? MAX_PARTS_SIDE : nparts_v);
+        cache_key_init(&key, region.width, region.height, 0,
+            region.c_start_re, region.c_start_im, region.c_end_re, region.c_end_im);
+    }
+    // the same image is already being rendered, for another client
+    if (!flight_join(flights, &key, sizeof(key), srv_request)) {
+        fprintf(stderr, "waiting for the job in flight\n");
+        free(response);
+        return;
+    }
 
-	img_t *img = image_new(region.width, region.height);
+    int nparts = nparts_v * nparts_h;
+    job_t *job = (job_t *)calloc(1, sizeof(job_t) + (size_t)nparts * sizeof(part_t));
+	img_t *img = job ? image_new(region.width, region.height) : NULL;
 	if (!img) {
+        // nobody joined yet, this is the only thread
+        flight_leave(flights, &key, sizeof(key));
+        free(job);
         http_response_status(response, 500);
         http_response_header(response, "Content-Type", "text/plain");
         http_response_body(response, OOM_RESPONSE, sizeof(OOM_RESPONSE) - 1);
         http_respond(srv_request, response);
         return;
 	}
+    // the response is sent by job_finish(), when the workers are done
+    free(response);
 
-	image_fill(img, 255, 255, 255);
-
-    int nworkers_h = DEFAULT_NWORKER_H;
-    int nworkers_v = DEFAULT_NWORKER_V;
-    int nworkers = nworkers_v * nworkers_h;
-
-    worker_t worker[MAX_WORKERS];
-
-    for (int i = 0; i < nworkers; i++) {
-        memset(&worker[i], 0, sizeof(worker_t));
-        worker[i].request = NULL;
-        worker[i].status = HTTP_STATUS_PENDING;
-        worker[i].received = -1;
-    }
-
-    double region_c_w = (region.c_end_re - region.c_start_re) / (double)nworkers_h;
-    double region_c_h = (region.c_end_im - region.c_start_im) / (double)nworkers_v;
-    int n_running = 0;
-    for (int i = 0; i < nworkers_v; i++) {
-        for (int j = 0; j < nworkers_h; j++) {
-            int worker_no = (i * nworkers_h) + j;
-            worker_t *worker_ptr = &worker[worker_no];
-
-            worker_ptr->worker_no = worker_no;
-            worker_ptr->row = i;
-            worker_ptr->column = j;
-            mandelbrot_region_t *w_region_ptr = &(worker_ptr->region);
-            w_region_ptr->width = region.width / nworkers_h;
-            w_region_ptr->height = region.height / nworkers_v;
-            w_region_ptr->c_start_re = region.c_start_re + (region_c_w * (double)j);
-            w_region_ptr->c_end_re   = w_region_ptr->c_start_re + region_c_w;
-            w_region_ptr->c_start_im = region.c_start_im + (region_c_h * (double)i);
-            w_region_ptr->c_end_im   = w_region_ptr->c_start_im + region_c_h;
-
-            char url[MAX_URL_SIZE + 1];
-#ifdef LOCAL_USE
-            sprintf(url, "http://127.0.0.1:8000/%d/%d/%lf/%lf/%lf/%lf",
-                w_region_ptr->width, w_region_ptr->height,
-                w_region_ptr->c_start_re, w_region_ptr->c_start_im,
-                w_region_ptr->c_end_re, w_region_ptr->c_end_im);
-#else
-            sprintf(url, "http://%s%d:8000/%d/%d/%lf/%lf/%lf/%lf", DEFAULT_WORKER_BASE_NAME, worker_no,
-                w_region_ptr->width, w_region_ptr->height,
-                w_region_ptr->c_start_re, w_region_ptr->c_start_im,
-                w_region_ptr->c_end_re, w_region_ptr->c_end_im);
-#endif
-            fprintf(stderr, "making request to url %s\n", url);
-            http_t *request = http_get(url, NULL);
-            worker_ptr->request = request;
-            if (!request) {
-                fprintf(stderr, "Invalid request for worker %d (%dx%d)\n", worker_no, j, i);
-                // goto bad_request;
-            }
-            n_running++;
-        }
-    }
+    // not cleared: the parts cover the whole image, and the ones that fail
+    // are cleared by part_failed()
 
-    while (1) {
-        int n_completed = 0;
-        int n_failed = 0;
-        int n_pending = 0;
-        int n_transitions = 0;
-        for (int i = 0; i < nworkers; i++) {
-            worker_t *worker_ptr = &worker[i];
-            http_t *request = worker_ptr->request;
-            if (!request)
-                continue;
-            http_status_t status = http_process(request);
-            if (status == HTTP_STATUS_PENDING) {
-                n_pending++;
-            } else if (status == HTTP_STATUS_FAILED) {
-                n_failed++;
-            } else if (status == HTTP_STATUS_COMPLETED) {
-                n_completed++;
-            }
-            if (status != worker_ptr->status) {
-                worker_ptr->status = status;
-                n_transitions++;
-                if (status == HTTP_STATUS_FAILED) {
-                    fprintf(stderr, "worker[%d] status:FAILED  [%d] %s\n", i, (int)request->status_code, request->reason_phrase);
-                } else if (status == HTTP_STATUS_COMPLETED) {
-                    fprintf(stderr, "worker[%d] status:COMPLETED  received:%d\n", i, (int)request->response_size);
-                    if (!merge_worker_image(img, &region, worker_ptr)) {
-                        fprintf(stderr, "worker[%d] merge FAILED\n", i);
-                    }
-                }
-            }
-        }
-        if (n_transitions > 0) {
-            fprintf(stderr, "pending/failed/completed: %d/%d/%d\n", n_pending, n_failed, n_completed);
-        }
-        if (n_pending == 0) {
-            break;
-        }
+    job->srv_request = srv_request;
+    job->region = region;
+    job->img = img;
+    job->nparts = nparts;
+    job->t_start = time_ms();
+    job->key = key;
+    job->cache_result = is_tile;
+    if (is_tile) {
+        job->store_key = store_key;
     }
 
-    fprintf(stderr, "finishing handler work...\n");
+    job->next = jobs;
+    if (jobs)
+        jobs->prev = job;
+    jobs = job;
+    hedge_timer_arm(TRUE);
 
-    for (int i = 0; i < nworkers; i++) {
-        worker_t *worker_ptr = &worker[i];
-        http_t *request = worker_ptr->request;
-        if (!request)
-            continue;
-        http_release(request);
-    }
+    // the parts cover the pixels from x0 (included) to x1 (excluded), so
+    // that none is left out when the size isn't a multiple of their number,
+    // and their regions are the ones of those pixels in the whole image
+    double region_c_w = region.c_end_re - region.c_start_re;
+    double region_c_h = region.c_end_im - region.c_start_im;
+    for (int i = 0; i < nparts_v; i++) {
+        int y0 = (int)((long long)region.height * i / nparts_v);
+        int y1 = (int)((long long)region.height * (i + 1) / nparts_v);
+        for (int j = 0; j < nparts_h; j++) {
+            int x0 = (int)((long long)region.width * j / nparts_h);
+            int x1 = (int)((long long)region.width * (j + 1) / nparts_h);
+            part_t *part = &job->part[(i * nparts_h) + j];
 
-    // http_response_status(response, 200);
-    // http_response_header(response, "Content-Type", "text/plain");
-    // http_response_body(response, "OK", 2);
-    // http_respond(srv_request, response);
+            part->job = job;
+            part->row = i;
+            part->column = j;
+            part->x = x0;
+            part->y = y0;
+            part->received = -1;
+            mandelbrot_region_t *part_region = &(part->region);
+            part_region->width = x1 - x0;
+            part_region->height = y1 - y0;
+            part_region->c_start_re = region.c_start_re + region_c_w * ((double)x0 / (double)region.width);
+            part_region->c_end_re   = region.c_start_re + region_c_w * ((double)x1 / (double)region.width);
+            part_region->c_start_im = region.c_start_im + region_c_h * ((double)y0 / (double)region.height);
+            part_region->c_end_im   = region.c_start_im + region_c_h * ((double)y1 / (double)region.height);
 
-    char filename[PATHNAME_LEN + 1];
-    strcpy(filename, "/tmp/mandelXXXXXX.png");
-    int fd = mkstemp(filename);
-    if (fd >= 0)
-        close(fd);
-    if (strcmp(filename, "") == 0) {
-        strcpy(filename, "/tmp/mandeltmp.png");
-    }
-    if (!stbi_write_png(filename, img->width, img->height, 3, img->data, image_stride_size(img))) {
-        goto internal_error;
-    }
- 
-    size_t png_size = 0;
-    struct stat statbuf;
-    if (stat(filename, &statbuf) < 0) {
-        perror("stat");
-        goto internal_error;
-    }
-    png_size = statbuf.st_size;
-
-    char *buffer = malloc(png_size);
-    if (!buffer) {
-        goto internal_error;
-    }
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        perror("fopen");
-        goto internal_error;
-    }
-    if (fread(buffer, png_size, 1, fp) != 1) {
-        perror("fread");
-        goto internal_error;
+            part->status = HTTP_STATUS_PENDING;
+            part_queue(part, FALSE);
+        }
     }
-    fclose(fp);
-    fp = NULL;
-
-    http_response_status(response, 200);
-    http_response_header(response, "Content-Type", "image/png");
-    http_response_body(response, buffer, png_size);
-    http_respond(srv_request, response);
+    // all of them, before any can fail
+    job->n_pending = nparts;
+    parts_dispatch();
     return;
 
 not_found:
@@ -280,44 +1047,131 @@ not_found:
     fflush(stderr);
     return;
 
-internal_error:
-    http_response_status(response, 500);
+bad_request:
+    http_response_status(response, 400);
     http_response_header(response, "Content-Type", "text/plain");
-    http_response_body(response, INTERNAL_ERROR_RESPONSE, sizeof(INTERNAL_ERROR_RESPONSE) - 1);
+    http_response_body(response, BAD_REQUEST_RESPONSE, sizeof(BAD_REQUEST_RESPONSE) - 1);
     http_respond(srv_request, response);
+    fprintf(stderr, "returned BAD REQUEST response for url '%s'\n", url_str);
+    fflush(stderr);
     return;
 }
 
-int merge_worker_image(img_t *dst, mandelbrot_region_t *dst_region, worker_t *worker)
+// job_max_iter() records that a part of job was rendered with max_iter
+// iterations (-1 if unknown)
+void job_max_iter(job_t *job, int max_iter) {
+    if (job->max_iter == 0)
+        job->max_iter = max_iter;
+    else if (job->max_iter != max_iter)
+        job->max_iter = -1;
+}
+
+// palette_get() returns the palette for max_iter, made again only when the
+// workers use a different max_iter
+img_palette_t *palette_get(int max_iter)
 {
-    http_t *worker_request = worker->request;
-    mandelbrot_region_t *worker_region = &(worker->region);
-    int width = 0, height = 0, channels = 0;
+    if (!palette || palette->max_iter != max_iter) {
+        image_palette_destroy(palette);
+        palette = image_palette_new(max_iter);
+    }
+    return palette;
+}
 
-    const unsigned char *data = stbi_load_from_memory((const unsigned char *) worker_request->response_data, (int) worker_request->response_size,
-            &width, &height, &channels, 3);
-    if (!data) {
-        fprintf(stderr, "can't load image from worker %d\n", worker->worker_no);
+// merge_part_iters() colorizes the iteration counts sent by a worker
+// straight into their place in the destination image
+int merge_part_iters(img_t *dst, part_t *part, http_t *worker_request)
+{
+    mandelbrot_region_t *part_region = &(part->region);
+    iter_header_t hdr;
+
+    if (!iter_read_header((const uint8_t *) worker_request->response_data, worker_request->response_size, &hdr)) {
+        fprintf(stderr, "bad iteration data from worker %s\n", part->host->name);
         return FALSE;
     }
-    if (channels != 3) {
-        fprintf(stderr, "got different number of channels (%d)\n", channels);
+    if (hdr.width != part_region->width || hdr.height != part_region->height || hdr.max_iter <= 0 || hdr.max_iter > UINT16_MAX) {
+        fprintf(stderr, "got different size from worker %s (%dx%d)\n", part->host->name, hdr.width, hdr.height);
         return FALSE;
     }
 
-    img_t *src = image_new(worker_region->width, worker_region->height);
-    if (! src) {
-        fprintf(stderr, "can't create image for worker %d results\n", worker->worker_no);
+    img_palette_t *colors = palette_get(hdr.max_iter);
+    uint16_t *iters = (uint16_t *)malloc((size_t)hdr.width * sizeof(uint16_t));
+    if (!colors || !iters) {
+        fprintf(stderr, "can't allocate row for worker %s results\n", part->host->name);
+        free(iters);
         return FALSE;
     }
 
-    memcpy(src->data, data, image_data_size(src));
+    // the part of dst where the counts go, rows colorized in place
+    img_t view;
+    image_view(&view, dst, part->x, part->y, hdr.width, hdr.height);
+    for (int y = 0; y < view.height; y++) {
+        iter_get_row(&hdr, (const uint8_t *) worker_request->response_data, y, iters);
+        image_colorize_row(&view, y, iters, colors);
+    }
+    job_max_iter(part->job, hdr.max_iter);
+    free(iters);
+    return TRUE;
+}
 
-    stbi_image_free((void *)data);
+// render_part_locally() renders part here, as a worker would have
+int render_part_locally(img_t *dst, part_t *part)
+{
+    mandelbrot_region_t *region = &(part->region);
 
-    int dst_x0 = worker->column * worker_region->width;
-    int dst_y0 = worker->row * worker_region->height;
-    image_blit(dst, src, dst_x0, dst_y0, worker_region->width, worker_region->height, 0, 0);
+    img_palette_t *colors = palette_get(MAX_ITER);
+    uint16_t *iters = (uint16_t *)malloc((size_t)region->width * sizeof(uint16_t));
+    if (!colors || !iters) {
+        fprintf(stderr, "can't allocate row for part %dx%d\n", part->column, part->row);
+        free(iters);
+        return FALSE;
+    }
+
+    img_t view;
+    image_view(&view, dst, part->x, part->y, region->width, region->height);
+    double c_im;
+    for (int y = 0; y < view.height; y++) {
+        c_im = region->c_start_im + ((double)y / (double)region->height) * (region->c_end_im - region->c_start_im);
+
+        mandel_row(region->c_start_re, region->c_end_re, region->width, 0, view.width, c_im, MAX_ITER, iters);
+        image_colorize_row(&view, y, iters, colors);
+    }
+    job_max_iter(part->job, MAX_ITER);
+    free(iters);
+    return TRUE;
+}
+
+int merge_part_image(img_t *dst, part_t *part, http_t *worker_request)
+{
+    mandelbrot_region_t *part_region = &(part->region);
+    int width = 0, height = 0, channels = 0;
+
+    if (strcmp(worker_request->content_type, ITER_CONTENT_TYPE) == 0) {
+        return merge_part_iters(dst, part, worker_request);
+    }
+
+    unsigned char *data = stbi_load_from_memory((const unsigned char *) worker_request->response_data, (int) worker_request->response_size,
+            &width, &height, &channels, 3);
+    if (!data) {
+        fprintf(stderr, "can't load image from worker %s\n", part->host->name);
+        return FALSE;
+    }
+    if (width != part_region->width || height != part_region->height) {
+        fprintf(stderr, "got different size from worker %s (%dx%d)\n", part->host->name, width, height);
+        stbi_image_free(data);
+        return FALSE;
+    }
+
+    // blitted straight from the decoded pixels (stb_image can't decode
+    // into a view of dst)
+    img_t src;
+    src.width = width;
+    src.height = height;
+    src.stride = (size_t)3 * (size_t)width;
+    src.data = data;
+    image_blit(dst, &src, part->x, part->y, part_region->width, part_region->height, 0, 0);
+    stbi_image_free(data);
+    // a PNG doesn't tell the iterations it was rendered with
+    job_max_iter(part->job, -1);
     return TRUE;
 }
 
@@ -334,9 +1188,77 @@ int main(void) {
 		port = atoi(port_str);
 	}
 
+    flights = flights_new();
+    pool = http_pool_create(NULL);
+    if (!flights || !pool) {
+        fprintf(stderr, "can't allocate the jobs table\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int cache_mb = DEFAULT_CACHE_MB;
+    const char *cache_mb_str = getenv("CACHE_MB");
+    if (cache_mb_str && (strcmp(cache_mb_str, "") != 0)) {
+        cache_mb = atoi(cache_mb_str);
+    }
+    if (cache_mb < 0)
+        cache_mb = 0;
+    cache = cache_new((size_t)cache_mb * 1024 * 1024);
+    if (!cache) {
+        fprintf(stderr, "can't allocate the tile cache\n");
+        exit(EXIT_FAILURE);
+    }
+
+    const char *store_path = getenv("TILE_STORE");
+    if (store_path && (strcmp(store_path, "") != 0)) {
+        int store_mb = DEFAULT_TILE_STORE_MB;
+        const char *store_mb_str = getenv("TILE_STORE_MB");
+        if (store_mb_str && (strcmp(store_mb_str, "") != 0)) {
+            store_mb = atoi(store_mb_str);
+        }
+        double t_start = time_ms();
+        store = store_open(store_path, (size_t)(store_mb > 0 ? store_mb : 1) * 1024 * 1024);
+        if (!store) {
+            fprintf(stderr, "can't open the tile store %s: %s\n", store_path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        store_stats_t stats;
+        store_get_stats(store, &stats);
+        fprintf(stderr, "tile store %s: %zu tiles (%lg ms)\n", store_path, stats.entries, time_ms() - t_start);
+    }
+
+    if (!hosts_load()) {
+        exit(EXIT_FAILURE);
+    }
+
     signal(SIGINT, sig_handler);
+    // SIGHUP is read from reload_signal.fd by the server loop, and by no
+    // other thread
+    sigset_t reload_mask;
+    sigemptyset(&reload_mask);
+    sigaddset(&reload_mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &reload_mask, NULL);
+    reload_signal.handler = reload_signal_cb;
+    reload_signal.fd = signalfd(-1, &reload_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (reload_signal.fd < 0) {
+        fprintf(stderr, "can't handle SIGHUP\n");
+        exit(EXIT_FAILURE);
+    }
 
     fprintf(stderr, "listening on port %d...\n", port);
-    struct http_server_s* server = http_server_init(port, handle_request);
+    server = http_server_init(port, handle_request);
+
+    hedge_timer.handler = hedge_tick_cb;
+    hedge_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (hedge_timer.fd < 0) {
+        fprintf(stderr, "can't create the hedging timer\n");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &hedge_timer;
+    epoll_ctl(http_server_loop(server), EPOLL_CTL_ADD, hedge_timer.fd, &ev);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &reload_signal;
+    epoll_ctl(http_server_loop(server), EPOLL_CTL_ADD, reload_signal.fd, &ev);
     http_server_listen(server);
 }
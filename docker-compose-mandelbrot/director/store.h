@@ -0,0 +1,535 @@
+#ifndef STORE_H
+#define STORE_H
+
+/*
+ * Persistent store of rendered tiles.
+ *
+ * The tiles are appended to a single file, which is memory mapped: the data
+ * returned by store_get() points straight into the mapping and stays valid,
+ * even if the file gets compacted in the meantime, until it's released with
+ * store_release(), which has the signature of free() so that it can be
+ * handed to http_response_body_owned(). When the store is opened the records
+ * already in the file are indexed, so the tiles rendered before a restart are
+ * served again right away.
+ *
+ * The file never grows beyond the size given to store_open(): when a new tile
+ * doesn't fit, the most recently used tiles (up to half of that size) are
+ * copied to a new file, which replaces the old one. The copy is made without
+ * holding the lock of the store, so store_get() isn't held up meanwhile; the
+ * tiles put while it runs are not stored.
+ *
+ * Each record is written with its header last, and the file is truncated at
+ * the first incomplete record when it's opened, so a process killed while
+ * writing loses at most the tile it was writing. The file is locked, and can
+ * be used by a single process at a time (by any number of its threads).
+ *
+ * Do this:
+ *   #define STORE_IMPLEMENTATION
+ * before including this file in *one* C file to create the implementation.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* --------------------------------------------------------------------
+ *   TYPES
+ * -------------------------------------------------------------------- */
+
+// store keys must be built with store_key_init(), they're written as they
+// are in the file
+typedef struct store_key {
+	int32_t z;
+	int32_t x;
+	int32_t y;
+	int32_t max_iter;
+	int32_t palette;		// of the renderer, 0 for the grey one
+} store_key_t;
+
+typedef struct store_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t compactions;
+	size_t entries;
+	size_t size;			// bytes used in the file
+	size_t capacity;
+} store_stats_t;
+
+typedef struct store store_t;
+
+/* --------------------------------------------------------------------
+ *   PROTOTYPES
+ * -------------------------------------------------------------------- */
+
+// store_open() opens (or creates) the store file at path, which will be kept
+// within max_size bytes; returns NULL on failure, with errno set
+store_t *store_open(const char *path, size_t max_size);
+
+// store_key_init() builds the key of the tile (z, x, y) rendered with
+// max_iter iterations and coloured with the given palette
+void store_key_init(store_key_t *key, int z, int x, int y, int max_iter, int palette);
+
+// store_get() returns the tile stored for key and its size, or NULL if
+// there's none. The tile must be released with store_release().
+const uint8_t *store_get(store_t *store, const store_key_t *key, size_t *size);
+
+// store_put() appends a tile to the file, unless it's already there; returns
+// 0 if it can't be stored
+int store_put(store_t *store, const store_key_t *key, const uint8_t *data, size_t size);
+
+void store_release(void *data);
+
+void store_get_stats(store_t *store, store_stats_t *stats);
+
+#endif /* STORE_H */
+
+#ifdef STORE_IMPLEMENTATION
+#ifndef STORE_IMPLEMENTATION_ONCE
+#define STORE_IMPLEMENTATION_ONCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* --------------------------------------------------------------------
+ *   MACROS AND CONSTANTS
+ * -------------------------------------------------------------------- */
+
+#define STORE_MAGIC 0x3253544dU	// "MTS2", files of older versions are dropped
+#define STORE_BUCKETS 4096		// must be a power of two
+#define STORE_ALIGN 8			// records start at multiples of this
+
+/* --------------------------------------------------------------------
+ *   TYPES
+ * -------------------------------------------------------------------- */
+
+// header of a record in the file, followed by size bytes of data
+typedef struct store_record {
+	uint32_t magic;
+	uint32_t size;
+	store_key_t key;
+} store_record_t;
+
+typedef struct store_map {
+	uint8_t *base;
+	size_t length;
+	int refs;			// the store holds one while the map is current
+	struct store_map *next;
+} store_map_t;
+
+typedef struct store_entry {
+	store_key_t key;
+	size_t offset;			// of the data, in the file
+	size_t size;
+	uint64_t used;			// store->tick when last stored or read
+	struct store_entry *next;
+} store_entry_t;
+
+struct store {
+	pthread_mutex_t lock;
+	char *path;
+	int fd;
+	store_map_t *map;
+	size_t end;			// where the next record goes
+	uint64_t tick;
+	int compacting;			// by store_compact(), without the lock
+	store_entry_t *buckets[STORE_BUCKETS];
+	store_stats_t stats;
+};
+
+/* --------------------------------------------------------------------
+ *   CODE
+ * -------------------------------------------------------------------- */
+
+// every map still in use, so that store_release() can find the one the
+// data belongs to
+static pthread_mutex_t store_maps_lock = PTHREAD_MUTEX_INITIALIZER;
+static store_map_t *store_maps = NULL;
+
+static size_t store_record_length(size_t size)
+{
+	return (sizeof(store_record_t) + size + STORE_ALIGN - 1) & ~(size_t)(STORE_ALIGN - 1);
+}
+
+static uint32_t store_hash(const store_key_t *key)
+{
+	// FNV-1a
+	const uint8_t *p = (const uint8_t *)key;
+	uint32_t hash = 2166136261U;
+	for (size_t i = 0; i < sizeof(*key); i++) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+// store_map_new() maps length bytes of fd, past its end too, so that the
+// records appended later are readable without mapping the file again
+static store_map_t *store_map_new(int fd, size_t length)
+{
+	store_map_t *map = (store_map_t *)malloc(sizeof(store_map_t));
+	if (!map)
+		return NULL;
+	void *base = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		free(map);
+		return NULL;
+	}
+	map->base = (uint8_t *)base;
+	map->length = length;
+	map->refs = 1;
+
+	pthread_mutex_lock(&store_maps_lock);
+	map->next = store_maps;
+	store_maps = map;
+	pthread_mutex_unlock(&store_maps_lock);
+	return map;
+}
+
+static void store_map_unref(store_map_t *map)
+{
+	pthread_mutex_lock(&store_maps_lock);
+	if (--map->refs > 0) {
+		pthread_mutex_unlock(&store_maps_lock);
+		return;
+	}
+	store_map_t **link = &store_maps;
+	while (*link != map)
+		link = &(*link)->next;
+	*link = map->next;
+	pthread_mutex_unlock(&store_maps_lock);
+
+	munmap(map->base, map->length);
+	free(map);
+}
+
+static store_entry_t *store_find(store_t *store, const store_key_t *key)
+{
+	store_entry_t *entry = store->buckets[store_hash(key) & (STORE_BUCKETS - 1)];
+	while (entry) {
+		if (memcmp(&entry->key, key, sizeof(*key)) == 0)
+			return entry;
+		entry = entry->next;
+	}
+	return NULL;
+}
+
+static void store_insert(store_t *store, store_entry_t *entry)
+{
+	store_entry_t **bucket = &store->buckets[store_hash(&entry->key) & (STORE_BUCKETS - 1)];
+	entry->next = *bucket;
+	*bucket = entry;
+}
+
+// store_index() adds the records in the first size bytes of the file to the
+// index, and returns where the valid records end
+static size_t store_index(store_t *store, size_t size)
+{
+	size_t offset = 0;
+
+	while (offset + sizeof(store_record_t) <= size) {
+		const store_record_t *record = (const store_record_t *)(store->map->base + offset);
+		if (record->magic != STORE_MAGIC || record->size > size - offset - sizeof(store_record_t))
+			break;
+
+		store_entry_t *entry = store_find(store, &record->key);
+		if (!entry) {
+			entry = (store_entry_t *)malloc(sizeof(store_entry_t));
+			if (!entry)
+				break;
+			entry->key = record->key;
+			store_insert(store, entry);
+			store->stats.entries++;
+		}
+		entry->offset = offset + sizeof(store_record_t);
+		entry->size = record->size;
+		entry->used = ++store->tick;
+		offset += store_record_length(record->size);
+	}
+	return offset;
+}
+
+store_t *store_open(const char *path, size_t max_size)
+{
+	struct stat st;
+
+	store_t *store = (store_t *)calloc(1, sizeof(store_t));
+	if (!store)
+		return NULL;
+	store->fd = -1;
+	store->path = strdup(path);
+	if (!store->path)
+		goto error;
+	store->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (store->fd < 0)
+		goto error;
+	if (flock(store->fd, LOCK_EX | LOCK_NB) < 0 || fstat(store->fd, &st) < 0)
+		goto error;
+
+	size_t size = (size_t)st.st_size;
+	store->map = store_map_new(store->fd, size > max_size ? size : max_size);
+	if (!store->map)
+		goto error;
+	pthread_mutex_init(&store->lock, NULL);
+	store->stats.capacity = max_size;
+
+	store->end = store_index(store, size);
+	if (store->end < size) {
+		fprintf(stderr, "store %s: dropping %zu bytes after the last complete record\n", path, size - store->end);
+		if (ftruncate(store->fd, (off_t)store->end) < 0)
+			goto error;
+	}
+	store->stats.size = store->end;
+	return store;
+
+error:
+	{
+		int err = errno;
+		if (store->map)
+			store_map_unref(store->map);
+		if (store->fd >= 0)
+			close(store->fd);
+		free(store->path);
+		free(store);
+		errno = err;
+	}
+	return NULL;
+}
+
+void store_key_init(store_key_t *key, int z, int x, int y, int max_iter, int palette)
+{
+	memset(key, 0, sizeof(*key));
+	key->z = z;
+	key->x = x;
+	key->y = y;
+	key->max_iter = max_iter;
+	key->palette = palette;
+}
+
+const uint8_t *store_get(store_t *store, const store_key_t *key, size_t *size)
+{
+	pthread_mutex_lock(&store->lock);
+	store_entry_t *entry = store_find(store, key);
+	if (!entry) {
+		store->stats.misses++;
+		pthread_mutex_unlock(&store->lock);
+		return NULL;
+	}
+	store->stats.hits++;
+	entry->used = ++store->tick;
+
+	store_map_t *map = store->map;
+	pthread_mutex_lock(&store_maps_lock);
+	map->refs++;
+	pthread_mutex_unlock(&store_maps_lock);
+	pthread_mutex_unlock(&store->lock);
+
+	*size = entry->size;
+	return map->base + entry->offset;
+}
+
+static int store_write(int fd, const void *data, size_t size, size_t offset)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	while (size > 0) {
+		ssize_t written = pwrite(fd, p, size, (off_t)offset);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		p += written;
+		size -= (size_t)written;
+		offset += (size_t)written;
+	}
+	return 1;
+}
+
+// store_append() writes a record at offset, header last
+static int store_append(int fd, const store_key_t *key, const uint8_t *data, size_t size, size_t offset)
+{
+	store_record_t record;
+	memset(&record, 0, sizeof(record));
+	record.magic = STORE_MAGIC;
+	record.size = (uint32_t)size;
+	record.key = *key;
+
+	return store_write(fd, data, size, offset + sizeof(record)) &&
+		store_write(fd, &record, sizeof(record), offset);
+}
+
+static int store_entry_cmp_used(const void *a, const void *b)
+{
+	const store_entry_t *ea = *(const store_entry_t *const *)a;
+	const store_entry_t *eb = *(const store_entry_t *const *)b;
+	// most recently used first
+	return ea->used < eb->used ? 1 : (ea->used > eb->used ? -1 : 0);
+}
+
+// store_compact() replaces the file with one holding only the most recently
+// used records, up to half of the capacity. Called with the lock held, which
+// is released while the records are copied: meanwhile the index and the file
+// don't change, since no other compaction starts and store_put() stores
+// nothing, and store_get() keeps reading the old map.
+static int store_compact(store_t *store)
+{
+	size_t n = store->stats.entries;
+	store_entry_t **entries = (store_entry_t **)malloc((n ? n : 1) * sizeof(store_entry_t *));
+	size_t *offsets = (size_t *)malloc((n ? n : 1) * sizeof(size_t));
+	char *tmp_path = (char *)malloc(strlen(store->path) + 5);
+	store_map_t *old_map = store->map;
+	int fd = -1;
+	store_map_t *map = NULL;
+
+	if (!entries || !offsets || !tmp_path) {
+		free(entries);
+		free(offsets);
+		free(tmp_path);
+		return 0;
+	}
+	size_t i = 0;
+	for (int b = 0; b < STORE_BUCKETS; b++) {
+		for (store_entry_t *entry = store->buckets[b]; entry; entry = entry->next)
+			entries[i++] = entry;
+	}
+	qsort(entries, n, sizeof(store_entry_t *), store_entry_cmp_used);
+
+	size_t end = 0, kept = 0;
+	for (kept = 0; kept < n; kept++) {
+		size_t length = store_record_length(entries[kept]->size);
+		if (end + length > store->stats.capacity / 2)
+			break;
+		offsets[kept] = end + sizeof(store_record_t);
+		end += length;
+	}
+
+	store->compacting = 1;
+	pthread_mutex_unlock(&store->lock);
+
+	sprintf(tmp_path, "%s.tmp", store->path);
+	fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) < 0)
+		goto error;
+	for (i = 0; i < kept; i++) {
+		store_entry_t *entry = entries[i];
+		if (!store_append(fd, &entry->key, old_map->base + entry->offset, entry->size, offsets[i] - sizeof(store_record_t)))
+			goto error;
+	}
+	// on disk before it replaces the old file, or a crash could leave a
+	// truncated store behind
+	if (fsync(fd) < 0)
+		goto error;
+	map = store_map_new(fd, store->stats.capacity);
+	if (!map || rename(tmp_path, store->path) < 0)
+		goto error;
+
+	pthread_mutex_lock(&store->lock);
+	store->compacting = 0;
+	// the tiles being sent keep the old map alive
+	store_map_unref(old_map);
+	close(store->fd);
+	store->map = map;
+	store->fd = fd;
+	store->end = end;
+
+	memset(store->buckets, 0, sizeof(store->buckets));
+	for (i = 0; i < n; i++) {
+		if (i < kept) {
+			entries[i]->offset = offsets[i];
+			store_insert(store, entries[i]);
+		} else {
+			free(entries[i]);
+		}
+	}
+	store->stats.entries = kept;
+	store->stats.size = end;
+	store->stats.compactions++;
+
+	free(entries);
+	free(offsets);
+	free(tmp_path);
+	return 1;
+
+error:
+	fprintf(stderr, "store %s: compaction failed: %s\n", store->path, strerror(errno));
+	if (map)
+		store_map_unref(map);
+	if (fd >= 0) {
+		close(fd);
+		unlink(tmp_path);
+	}
+	free(entries);
+	free(offsets);
+	free(tmp_path);
+	pthread_mutex_lock(&store->lock);
+	store->compacting = 0;
+	return 0;
+}
+
+int store_put(store_t *store, const store_key_t *key, const uint8_t *data, size_t size)
+{
+	size_t length = store_record_length(size);
+	// anything larger would be thrown away by the next compaction
+	if (length > store->stats.capacity / 2 || size > UINT32_MAX)
+		return 0;
+
+	pthread_mutex_lock(&store->lock);
+	if (store_find(store, key)) {
+		// rendered by someone else in the meantime
+		pthread_mutex_unlock(&store->lock);
+		return 1;
+	}
+	// while a compaction runs the file is full, and left as it is
+	if (store->end + length > store->stats.capacity && (store->compacting || !store_compact(store))) {
+		pthread_mutex_unlock(&store->lock);
+		return 0;
+	}
+
+	store_entry_t *entry = (store_entry_t *)malloc(sizeof(store_entry_t));
+	if (!entry || !store_append(store->fd, key, data, size, store->end)) {
+		pthread_mutex_unlock(&store->lock);
+		free(entry);
+		return 0;
+	}
+	entry->key = *key;
+	entry->offset = store->end + sizeof(store_record_t);
+	entry->size = size;
+	entry->used = ++store->tick;
+	store_insert(store, entry);
+	store->end += length;
+	store->stats.entries++;
+	store->stats.size = store->end;
+	pthread_mutex_unlock(&store->lock);
+	return 1;
+}
+
+void store_release(void *data)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	store_map_t *map;
+
+	pthread_mutex_lock(&store_maps_lock);
+	for (map = store_maps; map; map = map->next) {
+		if (p >= map->base && p < map->base + map->length)
+			break;
+	}
+	pthread_mutex_unlock(&store_maps_lock);
+	if (map)
+		store_map_unref(map);
+}
+
+void store_get_stats(store_t *store, store_stats_t *stats)
+{
+	pthread_mutex_lock(&store->lock);
+	*stats = store->stats;
+	pthread_mutex_unlock(&store->lock);
+}
+
+#endif /* STORE_IMPLEMENTATION_ONCE */
+#endif /* STORE_IMPLEMENTATION */
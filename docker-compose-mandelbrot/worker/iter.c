@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iter.h"
+
+/* --------------------------------------------------------------------
+ *   CODE
+ * -------------------------------------------------------------------- */
+
+static void put_u16(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)(v & 0xff);
+	p[1] = (uint8_t)((v >> 8) & 0xff);
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+	put_u16(p, v & 0xffff);
+	put_u16(p + 2, (v >> 16) & 0xffff);
+}
+
+static void put_f64(uint8_t *p, double d)
+{
+	uint64_t v;
+	memcpy(&v, &d, sizeof(v));
+	put_u32(p, (uint32_t)(v & 0xffffffffUL));
+	put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t get_u16(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+	return get_u16(p) | (get_u16(p + 2) << 16);
+}
+
+static double get_f64(const uint8_t *p)
+{
+	uint64_t v = (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+	double d;
+	memcpy(&d, &v, sizeof(d));
+	return d;
+}
+
+void iter_header_init(iter_header_t *hdr, int width, int height, int max_iter,
+		double c_start_re, double c_start_im, double c_end_re, double c_end_im)
+{
+	hdr->width = width;
+	hdr->height = height;
+	hdr->max_iter = max_iter;
+	hdr->count_size = (max_iter <= UINT8_MAX) ? 1 : 2;
+	hdr->c_start_re = c_start_re;
+	hdr->c_start_im = c_start_im;
+	hdr->c_end_re = c_end_re;
+	hdr->c_end_im = c_end_im;
+}
+
+// iter_data_size() returns the size of the whole body, header included
+size_t iter_data_size(iter_header_t *hdr)
+{
+	return ITER_HEADER_SIZE + (size_t)hdr->width * (size_t)hdr->height * (size_t)hdr->count_size;
+}
+
+void iter_write_header(uint8_t *data, iter_header_t *hdr)
+{
+	memcpy(data, ITER_MAGIC, 4);
+	put_u16(data + 4, ITER_VERSION);
+	put_u16(data + 6, (uint32_t)hdr->count_size);
+	put_u32(data + 8, (uint32_t)hdr->width);
+	put_u32(data + 12, (uint32_t)hdr->height);
+	put_u32(data + 16, (uint32_t)hdr->max_iter);
+	put_u32(data + 20, 0);
+	put_f64(data + 24, hdr->c_start_re);
+	put_f64(data + 32, hdr->c_start_im);
+	put_f64(data + 40, hdr->c_end_re);
+	put_f64(data + 48, hdr->c_end_im);
+}
+
+// iter_read_header() parses and validates the header of a body of the given
+// size; returns 0 if it is malformed or doesn't match the body size
+int iter_read_header(const uint8_t *data, size_t size, iter_header_t *hdr)
+{
+	if (size < ITER_HEADER_SIZE || memcmp(data, ITER_MAGIC, 4) != 0)
+		return 0;
+	if (get_u16(data + 4) != ITER_VERSION)
+		return 0;
+	uint32_t count_size = get_u16(data + 6);
+	uint32_t width = get_u32(data + 8);
+	uint32_t height = get_u32(data + 12);
+	uint32_t max_iter = get_u32(data + 16);
+	if ((count_size != 1 && count_size != 2) || width > INT32_MAX || height > INT32_MAX || max_iter > UINT16_MAX)
+		return 0;
+	hdr->count_size = (int)count_size;
+	hdr->width = (int)width;
+	hdr->height = (int)height;
+	hdr->max_iter = (int)max_iter;
+	hdr->c_start_re = get_f64(data + 24);
+	hdr->c_start_im = get_f64(data + 32);
+	hdr->c_end_re = get_f64(data + 40);
+	hdr->c_end_im = get_f64(data + 48);
+	return size == iter_data_size(hdr);
+}
+
+// iter_put_row() stores the width counts of row y into the body data
+void iter_put_row(iter_header_t *hdr, uint8_t *data, int y, const uint16_t *iters)
+{
+	uint8_t *row = data + ITER_HEADER_SIZE + (size_t)y * (size_t)hdr->width * (size_t)hdr->count_size;
+	if (hdr->count_size == 1) {
+		for (int x = 0; x < hdr->width; x++)
+			row[x] = (uint8_t)iters[x];
+	} else {
+		for (int x = 0; x < hdr->width; x++)
+			put_u16(row + 2 * x, iters[x]);
+	}
+}
+
+// iter_get_row() loads the width counts of row y from the body data
+void iter_get_row(iter_header_t *hdr, const uint8_t *data, int y, uint16_t *iters)
+{
+	const uint8_t *row = data + ITER_HEADER_SIZE + (size_t)y * (size_t)hdr->width * (size_t)hdr->count_size;
+	if (hdr->count_size == 1) {
+		for (int x = 0; x < hdr->width; x++)
+			iters[x] = row[x];
+	} else {
+		for (int x = 0; x < hdr->width; x++)
+			iters[x] = (uint16_t)get_u16(row + 2 * x);
+	}
+}
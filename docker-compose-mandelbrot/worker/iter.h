@@ -0,0 +1,67 @@
+#ifndef ITER_H
+#define ITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Raw iteration-count transfer format (application/x-mandel-iter).
+ *
+ * A worker answers with this format, instead of a PNG, when the request
+ * carries "Accept: application/x-mandel-iter". The body is a fixed size
+ * header followed by width * height iteration counts, row by row, each
+ * count_size bytes wide (1 if max_iter fits in a byte, 2 otherwise).
+ * All fields are little endian:
+ *
+ *   offset  size  field
+ *        0     4  magic "MITR"
+ *        4     2  version (1)
+ *        6     2  count_size (1 or 2)
+ *        8     4  width
+ *       12     4  height
+ *       16     4  max_iter
+ *       20     4  reserved (0)
+ *       24     8  c_start_re (IEEE 754 double)
+ *       32     8  c_start_im
+ *       40     8  c_end_re
+ *       48     8  c_end_im
+ *       56        counts...
+ */
+
+/* --------------------------------------------------------------------
+ *   MACROS AND CONSTANTS
+ * -------------------------------------------------------------------- */
+
+#define ITER_CONTENT_TYPE "application/x-mandel-iter"
+#define ITER_MAGIC "MITR"
+#define ITER_VERSION 1
+#define ITER_HEADER_SIZE 56
+
+/* --------------------------------------------------------------------
+ *   TYPES
+ * -------------------------------------------------------------------- */
+
+typedef struct iter_header {
+	int width;
+	int height;
+	int max_iter;
+	int count_size;
+	double c_start_re;
+	double c_start_im;
+	double c_end_re;
+	double c_end_im;
+} iter_header_t;
+
+/* --------------------------------------------------------------------
+ *   PROTOTYPES
+ * -------------------------------------------------------------------- */
+
+void iter_header_init(iter_header_t *hdr, int width, int height, int max_iter,
+		double c_start_re, double c_start_im, double c_end_re, double c_end_im);
+size_t iter_data_size(iter_header_t *hdr);
+void iter_write_header(uint8_t *data, iter_header_t *hdr);
+int iter_read_header(const uint8_t *data, size_t size, iter_header_t *hdr);
+void iter_put_row(iter_header_t *hdr, uint8_t *data, int y, const uint16_t *iters);
+void iter_get_row(iter_header_t *hdr, const uint8_t *data, int y, uint16_t *iters);
+
+#endif /* ITER_H */
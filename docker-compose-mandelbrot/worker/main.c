@@ -1,10 +1,10 @@
 #define _GNU_SOURCE
 #include <stdint.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <math.h>
 #include <unistd.h>
 #include <signal.h>
-#include <sys/stat.h>
 #include <sys/time.h>
 
 #define HTTPSERVER_IMPL
@@ -13,10 +13,11 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
-
 #include "img.h"
+#include "iter.h"
+
+#define MANDEL_IMPLEMENTATION
+#include "mandel.h"
 
 #define DEFAULT_PORT 8000
 
@@ -35,7 +36,7 @@ typedef struct mandelbrot_region {
  *   - https://simple.wikipedia.org/wiki/Mandelbrot_set
  *
  * compile:
- *   $ gcc -std=c99 -Wall -o worker main.c img.c -lm
+ *   $ gcc -std=c99 -Wall -o worker main.c img.c iter.c -lm
  *
  * run:
  *   $ ./worker
@@ -45,10 +46,8 @@ typedef struct mandelbrot_region {
 
 #define MAX_ITER 100
 
-double complex_sq_abs(double re, double im)
-{
-	return (re * re) + (im * im);
-}
+// the colours of the iteration counts, shared by the render threads
+img_palette_t *palette = NULL;
 
 // time_ms() returns the number of ms since epoch (1 jan 1970)
 double time_ms(void)
@@ -58,32 +57,6 @@ double time_ms(void)
 	return ((t.tv_sec * (double)1000.0) + (t.tv_usec / (double)1000.0));
 }
 
-int mandelbrot(double c_re, double c_im)
-{
-	// z_0 = 0
-	// z_{n+1} = (z_n)^2 + c
-	// it's in the mandelbrot set if |z_n| < 2 after MAX_ITER
-
-	// |z| = |x+yi| = sqrt(x*x + y*y)
-	// (a	+bi)(c+di) = ac + adi + bci + bdi^2 = (ac−bd) + (ad+bc)i
-	// z^2 = (x+yi)^2 = (x^2-y^2) + (xy+yx)i = (x^2-y^2) + 2xyi
-
-	double z_re = 0.0, z_im = 0.0;
-	double z_new_re = 0.0, z_new_im = 0.0;
-	int n = 0;
-	while (n < MAX_ITER) {
-		if (complex_sq_abs(z_re, z_im) > 4.0)
-			break;
-		// z_{n+1} = (z_n)^2 + c
-		z_new_re = ((z_re * z_re) - (z_im * z_im)) + c_re;
-		z_new_im = 2 * z_re * z_im + c_im;
-
-		z_re = z_new_re;
-		z_im = z_new_im;
-		n++;
-	}
-	return n;
-}
 
 int request_target_is(struct http_request_s* request, char const * target) {
     http_string_t url = http_request_target(request);
@@ -91,13 +64,29 @@ int request_target_is(struct http_request_s* request, char const * target) {
     return len == url.len && memcmp(url.buf, target, url.len) == 0;
 }
 
+// request_accepts() tells if the Accept header of the request lists the
+// given media type
+int request_accepts(struct http_request_s* request, char const * type) {
+    http_string_t accept = http_request_header(request, "Accept");
+    int len = strlen(type);
+    for (int i = 0; i + len <= accept.len; i++) {
+        if (memcmp(accept.buf + i, type, len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
 #define OOM_RESPONSE "out of memory"
 #define NOT_FOUND "not found"
 #define INTERNAL_ERROR_RESPONSE "internal error"
-#define PATHNAME_LEN 240
+#define BAD_REQUEST_RESPONSE "bad image size"
 #define MAX_URL_SIZE 240
+// as mandelbrot-http-server: so that no body outgrows the int length of
+// http_response_body_owned()
+#define MAX_IMAGE_PIXELS (64 * 1024 * 1024)
 
-void handle_request(struct http_request_s* request) {
+// render_request() runs on one of the offload threads
+void render_request(struct http_request_s* request) {
     http_string_t url = http_request_target(request);
 
     struct http_response_s* response = http_response_init();
@@ -117,92 +106,119 @@ void handle_request(struct http_request_s* request) {
     }
     fprintf(stderr, "got request for: %d x %d (%lg,%lg)-(%lg,%lg)\n", region.width, region.height, region.c_start_re, region.c_start_im, region.c_end_re, region.c_end_im);
     fflush(stderr);
+    if (region.width <= 0 || region.height <= 0 || (int64_t)region.width * (int64_t)region.height > MAX_IMAGE_PIXELS) {
+        goto bad_request;
+    }
+
+    if (request_accepts(request, ITER_CONTENT_TYPE)) {
+        // ship the raw iteration counts, the director colorizes them
+        iter_header_t hdr;
+        iter_header_init(&hdr, region.width, region.height, MAX_ITER,
+                region.c_start_re, region.c_start_im, region.c_end_re, region.c_end_im);
+        size_t body_size = iter_data_size(&hdr);
+        if (body_size > INT_MAX) {
+            goto internal_error;
+        }
+        uint8_t *body = (uint8_t *)malloc(body_size);
+        uint16_t *iters = (uint16_t *)malloc((size_t)region.width * sizeof(uint16_t));
+        if (!body || !iters) {
+            free(body);
+            free(iters);
+            goto internal_error;
+        }
+        iter_write_header(body, &hdr);
+
+        double c_im;
+        for (int y = 0; y < region.height; y++) {
+            c_im = region.c_start_im + ((double)y / (double)region.height) * (region.c_end_im - region.c_start_im);
+
+            mandel_row(region.c_start_re, region.c_end_re, region.width, 0, region.width, c_im, MAX_ITER, iters);
+            iter_put_row(&hdr, body, y, iters);
+        }
+        free(iters);
+
+        http_response_status(response, 200);
+        http_response_header(response, "Content-Type", ITER_CONTENT_TYPE);
+        // freed by the server once sent
+        http_response_body_owned(response, (const char *)body, (int)body_size, free);
+        http_respond_async(request, response);
+        return;
+    }
 
 	img_t *img = image_new(region.width, region.height);
 	if (!img) {
         http_response_status(response, 500);
         http_response_header(response, "Content-Type", "text/plain");
         http_response_body(response, OOM_RESPONSE, sizeof(OOM_RESPONSE) - 1);
-        http_respond(request, response);
+        http_respond_async(request, response);
         return;
 	}
 
-	image_fill(img, 255, 255, 255);
+	uint16_t *iters = (uint16_t *)malloc((size_t)img->width * sizeof(uint16_t));
+	if (!iters) {
+		image_destroy(img);
+		goto internal_error;
+	}
 
-	double c_re, c_im;
+	double c_im;
 	for (int y = 0; y < img->height; y++) {
 		c_im = region.c_start_im + ((double)y / (double)img->height) * (region.c_end_im - region.c_start_im);
 
-		for (int x = 0; x < img->width; x++) {
-			c_re = region.c_start_re + ((double)x / (double)img->width) * (region.c_end_re - region.c_start_re);
-
-			int m = mandelbrot(c_re, c_im);
-			int color = 255 - (int)((double)m * 255.0 / (double)MAX_ITER);
-			image_set_pixel(img, x, y, (uint8_t)color, (uint8_t)color, (uint8_t)color);
-		}
+		mandel_row(region.c_start_re, region.c_end_re, img->width, 0, img->width, c_im, MAX_ITER, iters);
+		image_colorize_row(img, y, iters, palette);
 	}
-
-    char filename[PATHNAME_LEN + 1];
-    strcpy(filename, "/tmp/mandelXXXXXX.png");
-    int fd = mkstemp(filename);
-    if (fd >= 0)
-        close(fd);
-    if (strcmp(filename, "") == 0) {
-        strcpy(filename, "/tmp/mandeltmp.png");
-    }
-    if (!stbi_write_png(filename, img->width, img->height, 3, img->data, image_stride_size(img))) {
-        goto internal_error;
-    }
- 
-    size_t png_size = 0;
-    struct stat statbuf;
-    if (stat(filename, &statbuf) < 0) {
-        perror("stat");
-        goto internal_error;
-    }
-    png_size = statbuf.st_size;
-
-    char *buffer = malloc(png_size);
-    if (!buffer) {
-        goto internal_error;
-    }
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        perror("fopen");
-        goto internal_error;
-    }
-    if (fread(buffer, png_size, 1, fp) != 1) {
-        perror("fread");
+	free(iters);
+
+    img_buf_t png;
+    memset(&png, 0, sizeof(png));
+    int encoded = image_encode_png(img, &png);
+    image_destroy(img);
+    if (!encoded || png.size > INT_MAX) {
+        image_buf_free(&png);
         goto internal_error;
     }
-    fclose(fp);
-    fp = NULL;
 
     http_response_status(response, 200);
     http_response_header(response, "Content-Type", "image/png");
-    http_response_body(response, buffer, png_size);
-    http_respond(request, response);
+    // freed by the server once sent
+    http_response_body_owned(response, (const char *)png.data, (int)png.size, image_png_free);
+    http_respond_async(request, response);
     return;
 
 not_found:
     http_response_status(response, 404);
     http_response_header(response, "Content-Type", "text/plain");
     http_response_body(response, NOT_FOUND, sizeof(NOT_FOUND) - 1);
-    http_respond(request, response);
+    http_respond_async(request, response);
     fprintf(stderr, "returned NOT FOUND response for url '%s'\n", url_str);
     fflush(stderr);
     return;
 
+bad_request:
+    http_response_status(response, 400);
+    http_response_header(response, "Content-Type", "text/plain");
+    http_response_body(response, BAD_REQUEST_RESPONSE, sizeof(BAD_REQUEST_RESPONSE) - 1);
+    http_respond_async(request, response);
+    fprintf(stderr, "returned BAD REQUEST response for url '%s'\n", url_str);
+    fflush(stderr);
+    return;
+
 internal_error:
     http_response_status(response, 500);
     http_response_header(response, "Content-Type", "text/plain");
     http_response_body(response, INTERNAL_ERROR_RESPONSE, sizeof(INTERNAL_ERROR_RESPONSE) - 1);
-    http_respond(request, response);
+    http_respond_async(request, response);
     fprintf(stderr, "returned FAIL response\n");
     fflush(stderr);
     return;
 }
 
+// handle_request() runs on the server loop, which must not be kept busy while
+// the image is rendered
+void handle_request(struct http_request_s* request) {
+    http_request_offload(request, render_request);
+}
+
 void sig_handler(int signum) {
     fprintf(stderr, "exiting...\n");
     exit(EXIT_FAILURE);
@@ -216,9 +232,26 @@ int main(void) {
 		port = atoi(port_str);
 	}
 
+    // one reactor per core by default
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *threads_str = getenv("THREADS");
+    if (threads_str && (strcmp(threads_str, "") != 0)) {
+        threads = atoi(threads_str);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
     signal(SIGINT, sig_handler);
 
-    fprintf(stderr, "listening on port %d...\n", port);
-    struct http_server_s* server = http_server_init(port, handle_request);
+    palette = image_palette_new(MAX_ITER);
+    if (!palette) {
+        fprintf(stderr, "can't allocate the palette\n");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "listening on port %d (%d threads, %s kernel)...\n", port, threads, mandel_kernel_name());
+    struct http_server_s* server = http_server_init_threads(port, handle_request, threads);
+    http_server_set_offload_threads(server, threads);
     http_server_listen(server);
 }
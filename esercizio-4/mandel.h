@@ -0,0 +1,232 @@
+#ifndef MANDEL_H
+#define MANDEL_H
+
+/*
+ * Mandelbrot row kernel.
+ *
+ * Computes the iteration counts for a run of adjacent pixels on the same
+ * row, 8 (AVX-512) or 4 (AVX2) pixels at a time, falling back to the plain
+ * scalar loop when the CPU (or the compiler) lacks those instruction sets.
+ * The widest kernel is picked at runtime on the first call.
+ *
+ * Do this:
+ *   #define MANDEL_IMPLEMENTATION
+ * before including this file in *one* C file to create the implementation.
+ *
+ * Define MANDEL_NO_SIMD to build only the scalar kernel.
+ *
+ * The pixel at column x of an image `width` pixels wide maps to
+ *
+ *   c_re = c_start_re + ((double)x / (double)width) * (c_end_re - c_start_re)
+ *
+ * and every kernel evaluates exactly this expression (and the iteration
+ * below) without fused operations, so the results are identical across
+ * kernels.
+ */
+
+#include <stdint.h>
+
+/* --------------------------------------------------------------------
+ *   PROTOTYPES
+ * -------------------------------------------------------------------- */
+
+// mandel_row() stores in iters[0..count-1] the iteration counts of the pixels
+// x0..x0+count-1 of the row with imaginary part c_im.
+void mandel_row(double c_start_re, double c_end_re, int width, int x0, int count,
+		double c_im, int max_iter, uint16_t *iters);
+
+// mandel_kernel_name() returns the name of the kernel in use ("avx512",
+// "avx2" or "scalar").
+const char *mandel_kernel_name(void);
+
+#endif /* MANDEL_H */
+
+#ifdef MANDEL_IMPLEMENTATION
+#ifndef MANDEL_IMPLEMENTATION_ONCE
+#define MANDEL_IMPLEMENTATION_ONCE
+
+#include <stddef.h>
+
+#if !defined(MANDEL_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MANDEL_X86
+#include <immintrin.h>
+#endif
+
+/* --------------------------------------------------------------------
+ *   TYPES
+ * -------------------------------------------------------------------- */
+
+typedef void (*mandel_row_fn_t)(double c_start_re, double c_end_re, int width, int x0, int count,
+		double c_im, int max_iter, uint16_t *iters);
+
+/* --------------------------------------------------------------------
+ *   CODE
+ * -------------------------------------------------------------------- */
+
+static int mandel_scalar(double c_re, double c_im, int max_iter)
+{
+	// z_0 = 0
+	// z_{n+1} = (z_n)^2 + c
+	// it's in the mandelbrot set if |z_n| < 2 after max_iter
+
+	// |z| = |x+yi| = sqrt(x*x + y*y)
+	// (a+bi)(c+di) = ac + adi + bci + bdi^2 = (ac−bd) + (ad+bc)i
+	// z^2 = (x+yi)^2 = (x^2-y^2) + (xy+yx)i = (x^2-y^2) + 2xyi
+
+	double z_re = 0.0, z_im = 0.0;
+	double z_new_re = 0.0, z_new_im = 0.0;
+	int n = 0;
+	while (n < max_iter) {
+		if (((z_re * z_re) + (z_im * z_im)) > 4.0)
+			break;
+		// z_{n+1} = (z_n)^2 + c
+		z_new_re = ((z_re * z_re) - (z_im * z_im)) + c_re;
+		z_new_im = 2 * z_re * z_im + c_im;
+
+		z_re = z_new_re;
+		z_im = z_new_im;
+		n++;
+	}
+	return n;
+}
+
+static void mandel_row_scalar(double c_start_re, double c_end_re, int width, int x0, int count,
+		double c_im, int max_iter, uint16_t *iters)
+{
+	for (int i = 0; i < count; i++) {
+		double c_re = c_start_re + ((double)(x0 + i) / (double)width) * (c_end_re - c_start_re);
+		iters[i] = (uint16_t)mandel_scalar(c_re, c_im, max_iter);
+	}
+}
+
+#ifdef MANDEL_X86
+
+// Each lane runs the same iteration as mandel_scalar(). A lane stays active
+// while |z|^2 is not greater than 4 (NGT, so that NaNs keep iterating just
+// like in the scalar loop); once a lane escapes it is masked out for good and
+// its counter stops. The loop ends when every lane has escaped or max_iter is
+// reached.
+
+__attribute__((target("avx2")))
+static void mandel_row_avx2(double c_start_re, double c_end_re, int width, int x0, int count,
+		double c_im, int max_iter, uint16_t *iters)
+{
+	const __m256d four = _mm256_set1_pd(4.0);
+	const __m256d two = _mm256_set1_pd(2.0);
+	const __m256d one = _mm256_set1_pd(1.0);
+	const __m256d v_width = _mm256_set1_pd((double)width);
+	const __m256d v_start = _mm256_set1_pd(c_start_re);
+	const __m256d v_span = _mm256_set1_pd(c_end_re - c_start_re);
+	const __m256d v_c_im = _mm256_set1_pd(c_im);
+	const __m256d lane = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+
+	for (int i = 0; i < count; i += 4) {
+		__m256d x = _mm256_add_pd(_mm256_set1_pd((double)(x0 + i)), lane);
+		__m256d c_re = _mm256_add_pd(v_start, _mm256_mul_pd(_mm256_div_pd(x, v_width), v_span));
+		__m256d z_re = _mm256_setzero_pd();
+		__m256d z_im = _mm256_setzero_pd();
+		__m256d n = _mm256_setzero_pd();
+		__m256d active = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+
+		for (int k = 0; k < max_iter; k++) {
+			__m256d re2 = _mm256_mul_pd(z_re, z_re);
+			__m256d im2 = _mm256_mul_pd(z_im, z_im);
+			active = _mm256_and_pd(active, _mm256_cmp_pd(_mm256_add_pd(re2, im2), four, _CMP_NGT_UQ));
+			if (_mm256_movemask_pd(active) == 0)
+				break;
+			n = _mm256_add_pd(n, _mm256_and_pd(active, one));
+			__m256d z_new_im = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(two, z_re), z_im), v_c_im);
+			z_re = _mm256_add_pd(_mm256_sub_pd(re2, im2), c_re);
+			z_im = z_new_im;
+		}
+
+		int32_t out[4];
+		_mm_storeu_si128((__m128i *)out, _mm256_cvtpd_epi32(n));
+		int left = count - i < 4 ? count - i : 4;
+		for (int j = 0; j < left; j++)
+			iters[i + j] = (uint16_t)out[j];
+	}
+}
+
+__attribute__((target("avx512f")))
+static void mandel_row_avx512(double c_start_re, double c_end_re, int width, int x0, int count,
+		double c_im, int max_iter, uint16_t *iters)
+{
+	const __m512d four = _mm512_set1_pd(4.0);
+	const __m512d two = _mm512_set1_pd(2.0);
+	const __m512d one = _mm512_set1_pd(1.0);
+	const __m512d v_width = _mm512_set1_pd((double)width);
+	const __m512d v_start = _mm512_set1_pd(c_start_re);
+	const __m512d v_span = _mm512_set1_pd(c_end_re - c_start_re);
+	const __m512d v_c_im = _mm512_set1_pd(c_im);
+	const __m512d lane = _mm512_set_pd(7.0, 6.0, 5.0, 4.0, 3.0, 2.0, 1.0, 0.0);
+
+	for (int i = 0; i < count; i += 8) {
+		__m512d x = _mm512_add_pd(_mm512_set1_pd((double)(x0 + i)), lane);
+		__m512d c_re = _mm512_add_pd(v_start, _mm512_mul_pd(_mm512_div_pd(x, v_width), v_span));
+		__m512d z_re = _mm512_setzero_pd();
+		__m512d z_im = _mm512_setzero_pd();
+		__m512d n = _mm512_setzero_pd();
+		__mmask8 active = 0xff;
+
+		for (int k = 0; k < max_iter; k++) {
+			__m512d re2 = _mm512_mul_pd(z_re, z_re);
+			__m512d im2 = _mm512_mul_pd(z_im, z_im);
+			active = _mm512_mask_cmp_pd_mask(active, _mm512_add_pd(re2, im2), four, _CMP_NGT_UQ);
+			if (active == 0)
+				break;
+			n = _mm512_mask_add_pd(n, active, n, one);
+			__m512d z_new_im = _mm512_add_pd(_mm512_mul_pd(_mm512_mul_pd(two, z_re), z_im), v_c_im);
+			z_re = _mm512_add_pd(_mm512_sub_pd(re2, im2), c_re);
+			z_im = z_new_im;
+		}
+
+		int32_t out[8];
+		_mm256_storeu_si256((__m256i *)out, _mm512_cvtpd_epi32(n));
+		int left = count - i < 8 ? count - i : 8;
+		for (int j = 0; j < left; j++)
+			iters[i + j] = (uint16_t)out[j];
+	}
+}
+
+#endif /* MANDEL_X86 */
+
+static mandel_row_fn_t mandel_row_fn = NULL;
+static const char *mandel_row_fn_name = "scalar";
+
+static void mandel_select_kernel(void)
+{
+	mandel_row_fn_t fn = mandel_row_scalar;
+	const char *name = "scalar";
+#ifdef MANDEL_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		fn = mandel_row_avx512;
+		name = "avx512";
+	} else if (__builtin_cpu_supports("avx2")) {
+		fn = mandel_row_avx2;
+		name = "avx2";
+	}
+#endif
+	// every thread picks the same kernel, so a racy first call is harmless
+	mandel_row_fn_name = name;
+	mandel_row_fn = fn;
+}
+
+void mandel_row(double c_start_re, double c_end_re, int width, int x0, int count,
+		double c_im, int max_iter, uint16_t *iters)
+{
+	if (!mandel_row_fn)
+		mandel_select_kernel();
+	mandel_row_fn(c_start_re, c_end_re, width, x0, count, c_im, max_iter, iters);
+}
+
+const char *mandel_kernel_name(void)
+{
+	if (!mandel_row_fn)
+		mandel_select_kernel();
+	return mandel_row_fn_name;
+}
+
+#endif /* MANDEL_IMPLEMENTATION_ONCE */
+#endif /* MANDEL_IMPLEMENTATION */
@@ -5,6 +5,9 @@
 #include <math.h>
 #include <sys/time.h>
 
+#define MANDEL_IMPLEMENTATION
+#include "mandel.h"
+
 #include <pthread.h>
 
 /*
@@ -23,6 +26,18 @@
  *
  * run:
  *   $ ./mandelbrot >mandelbrot.ppm && convert mandelbrot.ppm mandelbrot.jpg
+ *
+ * usage:
+ *   $ ./mandelbrot-multi [N_THREADS [TILE_SIZE]] >mandelbrot.ppm
+ *
+ * the image is split into TILE_SIZE x TILE_SIZE tiles (the last row and
+ * column of tiles may be smaller), and each thread keeps taking the next
+ * tile from a shared counter until none are left, so threads working on
+ * the "slow" interior of the set don't hold back the others.
+ *
+ * the tiles only store the iteration counts, in a plane of 2 bytes per
+ * pixel; a second pass, again on N_THREADS threads taking bands of rows,
+ * turns them into colours through a table with one entry per count.
  */
 
 typedef void *(*thread_func_t) (void *);
@@ -34,6 +49,8 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr, thread_func_t
  * -------------------------------------------------------------------- */
 
 #define MAX_THREADS 128
+#define DEFAULT_TILE_SIZE 64
+#define COLOR_BAND_ROWS 16			// righe colorate per volta da un thread
 
 #define WIDTH	4000
 #define HEIGHT	3000
@@ -42,65 +59,60 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr, thread_func_t
  *   TYPES
  * -------------------------------------------------------------------- */
 
-typedef enum {
-	RED = 0,
-	GREEN = 1,
-	BLUE = 2,
-} ch_t;
-
-typedef uint8_t img_channel_t[HEIGHT][WIDTH];
-typedef img_channel_t img_t[3];
+// an image, or a view of a rectangle of another image (see image_view()):
+// row y starts at data + y * stride, with 3 bytes (r, g, b) per pixel, as
+// the ppm output wants them
+typedef struct image {
+	int width;
+	int height;
+	size_t stride;				// byte da una riga alla successiva
+	uint8_t *data;
+} img_t;
 
-img_t img;
+uint16_t iters[HEIGHT][WIDTH];			// iterazioni di ogni pixel
+uint8_t pixels[HEIGHT][3 * WIDTH];
+img_t img = { WIDTH, HEIGHT, 3 * WIDTH, &pixels[0][0] };
 
 typedef struct work {
-	int x0, y0;					// angolo in alto a sx
-	int x1, y1;					// angolo in basso a dx
+	int tile_size;				// lato di un tile in pixel
+	int tiles_h;				// tile per riga
+	int n_tiles;				// tile totali
+	int next_tile;				// prossimo tile da assegnare (condiviso)
+	int next_row;				// prima riga della prossima banda da colorare (condiviso)
 } work_t;
 
 /* --------------------------------------------------------------------
  *   CODE
  * -------------------------------------------------------------------- */
 
-void set_pixel(img_t img, int x, int y, uint8_t r, uint8_t g, uint8_t b)
+// image_view() makes view refer to the width x height rectangle of img at
+// (x0, y0), sharing its pixels; the rectangle must be inside img
+void image_view(img_t *view, img_t *img, int x0, int y0, int width, int height)
 {
-	img[RED][y][x]   = r;
-	img[GREEN][y][x] = g;
-	img[BLUE][y][x]  = b;
+	view->width = width;
+	view->height = height;
+	view->stride = img->stride;
+	view->data = img->data + (size_t)y0 * img->stride + (size_t)3 * (size_t)x0;
 }
 
-#define MAX_ITER 100
-
-double complex_sq_abs(double re, double im)
+uint8_t *image_row(img_t *img, int y)
 {
-	return (re * re) + (im * im);
+	return img->data + (size_t)y * img->stride;
 }
 
-int mandelbrot(double c_re, double c_im)
-{
-	// z_0 = 0
-	// z_{n+1} = (z_n)^2 + c
-	// it's in the mandelbrot set if |z_n| < 2 after MAX_ITER
-
-	// |z| = |x+yi| = sqrt(x*x + y*y)
-	// (a+bi)(c+di) = ac + adi + bci + bdi^2 = (ac−bd) + (ad+bc)i
-	// z^2 = (x+yi)^2 = (x^2-y^2) + (xy+yx)i = (x^2-y^2) + 2xyi
-
-	double z_re = 0.0, z_im = 0.0;
-	double z_new_re = 0.0, z_new_im = 0.0;
-	int n = 0;
-	while (n < MAX_ITER) {
-		if (complex_sq_abs(z_re, z_im) > 4.0)
-			break;
-		// z_{n+1} = (z_n)^2 + c
-		z_new_re = ((z_re * z_re) - (z_im * z_im)) + c_re;
-		z_new_im = 2 * z_re * z_im + c_im;
+#define MAX_ITER 100
+
+// the colour of every iteration count, see palette_init()
+uint8_t palette[MAX_ITER + 1][3];
 
-		z_re = z_new_re;
-		z_im = z_new_im;
-		n++;
+// palette_init() computes the grey of every iteration count once, from white
+// for the points escaping at once to black for the ones in the set
+void palette_init(void)
+{
+	for (int n = 0; n <= MAX_ITER; n++) {
+		int color = 255 - (int)((double)n * 255.0 / (double)MAX_ITER);
+		palette[n][0] = palette[n][1] = palette[n][2] = (uint8_t)color;
 	}
-	return n;
 }
 
 // time_ms() returns the number of ms since epoch (1 jan 1970)
@@ -108,84 +120,134 @@ double time_ms(void)
 {
 	struct timeval t;
 	gettimeofday(&t, NULL);
-	return ((t.tv_sec * (double)1000.0) + (t.tv_usec / (double)1000.0));
+	return (((double)t.tv_sec * (double)1000.0) + ((double)t.tv_usec / (double)1000.0));
 }
 
-void *thread_mandelbrot(void *data)
+// render_tile() computes the iteration counts of the rectangle
+// (x0,y0)-(x1,y1), corners included, straight into the iters plane
+void render_tile(int x0, int y0, int x1, int y1)
 {
 	double c_start_re = -2.0, c_start_im = -1.0, c_end_re = 1.0, c_end_im = 1.0;
-	// work_t *work = (work_t *)data;
-
-	int x0 = ((work_t *)data)->x0;
-	int y0 = ((work_t *)data)->y0;
-	int x1 = ((work_t *)data)->x1;
-	int y1 = ((work_t *)data)->y1;
 
-	double c_re, c_im;
+	double c_im;
 	for (int y = y0; y <= y1; y++) {
 		c_im = c_start_im + ((double)y / (double)HEIGHT) * (c_end_im - c_start_im);
 
-		for (int x = x0; x <= x1; x++) {
-			c_re = c_start_re + ((double)x / (double)WIDTH) * (c_end_re - c_start_re);
+		mandel_row(c_start_re, c_end_re, WIDTH, x0, x1 - x0 + 1, c_im, MAX_ITER, &iters[y][x0]);
+	}
+}
 
-			int m = mandelbrot(c_re, c_im);
-			int color = 255 - (int)((double)m * 255.0 / (double)MAX_ITER);
-			set_pixel(img, x, y, (uint8_t)color, (uint8_t)color, (uint8_t)color);
+// colorize_band() turns the iteration counts of the rows y0..y0+n_rows-1
+// into colours, writing them through a view of img
+void colorize_band(int y0, int n_rows)
+{
+	img_t band;
+	image_view(&band, &img, 0, y0, WIDTH, n_rows);
+
+	for (int y = 0; y < band.height; y++) {
+		const uint16_t *counts = iters[y0 + y];
+		uint8_t *row = image_row(&band, y);
+		for (int x = 0; x < band.width; x++) {
+			const uint8_t *color = palette[counts[x]];
+			row[3 * x + 0] = color[0];
+			row[3 * x + 1] = color[1];
+			row[3 * x + 2] = color[2];
 		}
 	}
+}
+
+void *thread_mandelbrot(void *data)
+{
+	work_t *work = (work_t *)data;
+
+	while (1) {
+		int tile = __atomic_fetch_add(&work->next_tile, 1, __ATOMIC_RELAXED);
+		if (tile >= work->n_tiles)
+			break;
+
+		int x0 = (tile % work->tiles_h) * work->tile_size;
+		int y0 = (tile / work->tiles_h) * work->tile_size;
+		int x1 = x0 + work->tile_size - 1;
+		int y1 = y0 + work->tile_size - 1;
+		if (x1 >= WIDTH)
+			x1 = WIDTH - 1;
+		if (y1 >= HEIGHT)
+			y1 = HEIGHT - 1;
+
+		render_tile(x0, y0, x1, y1);
+	}
+	return NULL;
+}
+
+void *thread_colorize(void *data)
+{
+	work_t *work = (work_t *)data;
+
+	while (1) {
+		int y0 = __atomic_fetch_add(&work->next_row, COLOR_BAND_ROWS, __ATOMIC_RELAXED);
+		if (y0 >= HEIGHT)
+			break;
+
+		int n_rows = COLOR_BAND_ROWS;
+		if (y0 + n_rows > HEIGHT)
+			n_rows = HEIGHT - y0;
+
+		colorize_band(y0, n_rows);
+	}
 	return NULL;
 }
 
 int main(int argc, char *argv[])
 {
-	work_t work[MAX_THREADS];
+	work_t work;
 	pthread_t thread[MAX_THREADS];
-	int h_threads = 1;
-	int v_threads = 1;
+	int n_threads = 1;
+	int tile_size = DEFAULT_TILE_SIZE;
 
 	if (argc > 1) {
-		h_threads = atoi(argv[1]);
+		n_threads = atoi(argv[1]);
 	}
 	if (argc > 2) {
-		v_threads = atoi(argv[2]);
-	}
-
-	for (int y = 0; y < HEIGHT; y++) {
-		for (int x = 0; x < WIDTH; x++) {
-			set_pixel(img, x, y, 255, 255, 255);
-		}
+		tile_size = atoi(argv[2]);
 	}
+	if (n_threads < 1)
+		n_threads = 1;
+	if (n_threads > MAX_THREADS)
+		n_threads = MAX_THREADS;
+	if (tile_size < 1)
+		tile_size = DEFAULT_TILE_SIZE;
+
+	work.tile_size = tile_size;
+	work.tiles_h = (WIDTH + tile_size - 1) / tile_size;
+	work.n_tiles = work.tiles_h * ((HEIGHT + tile_size - 1) / tile_size);
+	work.next_tile = 0;
+	work.next_row = 0;
+	fprintf(stderr, "n. threads: %d, tile size: %d (%d tiles)\n", n_threads, tile_size, work.n_tiles);
 
 	// lanciamo i thread
 	double t_start = time_ms();
-	int w_slice = WIDTH / h_threads;
-	int h_slice = HEIGHT / v_threads;
-	for (int i = 0; i < v_threads; i++) {
-		for (int j = 0; j < h_threads; j++) {
-			int x0 = w_slice * j;
-			int y0 = h_slice * i;
-			int x1 = x0 + w_slice - 1;		// w_slice * (i+1) - 1
-			int y1 = y0 + h_slice - 1;
-
-			int thread_index = (i * h_threads) + j;
-			work[thread_index].x0 = x0;
-			work[thread_index].y0 = y0;
-			work[thread_index].x1 = x1;
-			work[thread_index].y1 = y1;
-
-			pthread_create(&thread[thread_index], NULL, &thread_mandelbrot, &work[thread_index]);
-		}
+	for (int i = 0; i < n_threads; i++) {
+		pthread_create(&thread[i], NULL, &thread_mandelbrot, &work);
 	}
 
 	// aspettiamo che finiscano tutti i thread
-	for (int i = 0; i < v_threads; i++) {
-		for (int j = 0; j < h_threads; j++) {
-			int thread_index = (i * h_threads) + j;
-			pthread_join(thread[thread_index], NULL);
-		}
+	for (int i = 0; i < n_threads; i++) {
+		pthread_join(thread[i], NULL);
 	}
 	double t_end = time_ms();
-	fprintf(stderr, "calc time: %lg ms\n", (t_end - t_start));
+	fprintf(stderr, "calc time: %lg ms (%s kernel)\n", (t_end - t_start), mandel_kernel_name());
+
+	// coloriamo le iterazioni, di nuovo su n_threads thread
+	t_start = time_ms();
+	palette_init();
+	for (int i = 0; i < n_threads; i++) {
+		pthread_create(&thread[i], NULL, &thread_colorize, &work);
+	}
+	for (int i = 0; i < n_threads; i++) {
+		pthread_join(thread[i], NULL);
+	}
+	t_end = time_ms();
+	fprintf(stderr, "color time: %lg ms\n", (t_end - t_start));
 
 	// scriviamo l'immagine sull'output
 
@@ -194,16 +256,9 @@ int main(int argc, char *argv[])
 	// printf("# mandelbrot.ppm\n");
 	printf("%d %d\n", WIDTH, HEIGHT);
 	printf("%d\n", 255);
-	for (int y = 0; y < HEIGHT; y++) {
-		for (int x = 0; x < WIDTH; x++) {
-			uint8_t pixel[3];
-			pixel[0] = img[RED][y][x];
-			pixel[1] = img[GREEN][y][x];
-			pixel[2] = img[BLUE][y][x];
-			fwrite(pixel, sizeof(pixel), 1, stdout);
-			// printf(" %d %d %d  ", img[RED][y][x], img[GREEN][y][x], img[BLUE][y][x]);
-		}
-		// printf("\n");
+	// the pixels are already in ppm order: a row at a time
+	for (int y = 0; y < img.height; y++) {
+		fwrite(image_row(&img, y), 3, (size_t)img.width, stdout);
 	}
 	t_end = time_ms();
 	fprintf(stderr, "write time: %lg ms\n", (t_end - t_start));
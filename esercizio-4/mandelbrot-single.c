@@ -5,6 +5,9 @@
 #include <math.h>
 #include <sys/time.h>
 
+#define MANDEL_IMPLEMENTATION
+#include "mandel.h"
+
 /*
  * for an intro to the Mandelbrot set:
  *   - https://simple.wikipedia.org/wiki/Mandelbrot_set
@@ -44,6 +47,7 @@ typedef uint8_t img_channel_t[HEIGHT][WIDTH];
 typedef img_channel_t img_t[3];
 
 img_t img;
+uint16_t iters[HEIGHT][WIDTH];		// iterazioni di ogni pixel
 
 /* --------------------------------------------------------------------
  *   CODE
@@ -58,9 +62,17 @@ void set_pixel(img_t img, int x, int y, uint8_t r, uint8_t g, uint8_t b)
 
 #define MAX_ITER 100
 
-double complex_sq_abs(double re, double im)
+// the colour of every iteration count, see palette_init()
+uint8_t palette[MAX_ITER + 1][3];
+
+// palette_init() computes the grey of every iteration count once, from white
+// for the points escaping at once to black for the ones in the set
+void palette_init(void)
 {
-	return (re * re) + (im * im);
+	for (int n = 0; n <= MAX_ITER; n++) {
+		int color = 255 - (int)((double)n * 255.0 / (double)MAX_ITER);
+		palette[n][0] = palette[n][1] = palette[n][2] = (uint8_t)color;
+	}
 }
 
 // time_ms() returns the number of ms since epoch (1 jan 1970)
@@ -68,61 +80,34 @@ double time_ms(void)
 {
 	struct timeval t;
 	gettimeofday(&t, NULL);
-	return ((t.tv_sec * (double)1000.0) + (t.tv_usec / (double)1000.0));
-}
-
-int mandelbrot(double c_re, double c_im)
-{
-	// z_0 = 0
-	// z_{n+1} = (z_n)^2 + c
-	// it's in the mandelbrot set if |z_n| < 2 after MAX_ITER
-
-	// |z| = |x+yi| = sqrt(x*x + y*y)
-	// (a+bi)(c+di) = ac + adi + bci + bdi^2 = (ac−bd) + (ad+bc)i
-	// z^2 = (x+yi)^2 = (x^2-y^2) + (xy+yx)i = (x^2-y^2) + 2xyi
-
-	double z_re = 0.0, z_im = 0.0;
-	double z_new_re = 0.0, z_new_im = 0.0;
-	int n = 0;
-	while (n < MAX_ITER) {
-		if (complex_sq_abs(z_re, z_im) > 4.0)
-			break;
-		// z_{n+1} = (z_n)^2 + c
-		z_new_re = ((z_re * z_re) - (z_im * z_im)) + c_re;
-		z_new_im = 2 * z_re * z_im + c_im;
-
-		z_re = z_new_re;
-		z_im = z_new_im;
-		n++;
-	}
-	return n;
+	return (((double)t.tv_sec * (double)1000.0) + ((double)t.tv_usec / (double)1000.0));
 }
 
 int main(void)
 {
 	double c_start_re = -2.0, c_start_im = -1.0, c_end_re = 1.0, c_end_im = 1.0;
 
-	for (int y = 0; y < HEIGHT; y++) {
-		for (int x = 0; x < WIDTH; x++) {
-			set_pixel(img, x, y, 255, 255, 255);
-		}
-	}
-
 	double t_start = time_ms();
-	double c_re, c_im;
+	double c_im;
 	for (int y = 0; y < HEIGHT; y++) {
 		c_im = c_start_im + ((double)y / (double)HEIGHT) * (c_end_im - c_start_im);
 
-		for (int x = 0; x < WIDTH; x++) {
-			c_re = c_start_re + ((double)x / (double)WIDTH) * (c_end_re - c_start_re);
+		mandel_row(c_start_re, c_end_re, WIDTH, 0, WIDTH, c_im, MAX_ITER, iters[y]);
+	}
+	double t_end = time_ms();
+	fprintf(stderr, "calc time: %lg ms (%s kernel)\n", (t_end - t_start), mandel_kernel_name());
 
-			int m = mandelbrot(c_re, c_im);
-			int color = 255 - (int)((double)m * 255.0 / (double)MAX_ITER);
-			set_pixel(img, x, y, (uint8_t)color, (uint8_t)color, (uint8_t)color);
+	// coloriamo le iterazioni
+	t_start = time_ms();
+	palette_init();
+	for (int y = 0; y < HEIGHT; y++) {
+		for (int x = 0; x < WIDTH; x++) {
+			const uint8_t *color = palette[iters[y][x]];
+			set_pixel(img, x, y, color[0], color[1], color[2]);
 		}
 	}
-	double t_end = time_ms();
-	fprintf(stderr, "calc time: %lg ms\n", (t_end - t_start));
+	t_end = time_ms();
+	fprintf(stderr, "color time: %lg ms\n", (t_end - t_start));
 
 	t_start = time_ms();
 	printf("P3\n");
@@ -0,0 +1,308 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+/*
+ * LRU cache of rendered images.
+ *
+ * The images are keyed by their viewport (size, region of the complex plane
+ * and number of iterations) and the cache keeps at most `capacity` bytes of
+ * image data, evicting the least recently used images first. It can be used
+ * by several threads at once.
+ *
+ * The data returned by cache_get() and cache_put() stays valid, even if the
+ * image gets evicted in the meantime, until it's released with
+ * cache_release(), which has the signature of free() so that it can be
+ * handed to http_response_body_owned().
+ *
+ * Do this:
+ *   #define CACHE_IMPLEMENTATION
+ * before including this file in *one* C file to create the implementation.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* --------------------------------------------------------------------
+ *   TYPES
+ * -------------------------------------------------------------------- */
+
+// cache keys must be built with cache_key_init(), so that equal viewports
+// have equal keys
+typedef struct cache_key {
+	int width;
+	int height;
+	int max_iter;
+	double c_start_re;
+	double c_start_im;
+	double c_end_re;
+	double c_end_im;
+} cache_key_t;
+
+typedef struct cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	size_t entries;
+	size_t size;			// bytes of image data in the cache
+	size_t capacity;
+} cache_stats_t;
+
+typedef struct cache cache_t;
+
+/* --------------------------------------------------------------------
+ *   PROTOTYPES
+ * -------------------------------------------------------------------- */
+
+cache_t *cache_new(size_t capacity);
+
+void cache_key_init(cache_key_t *key, int width, int height, int max_iter,
+		double c_start_re, double c_start_im, double c_end_re, double c_end_im);
+
+// cache_get() returns the image stored for key and its size, or NULL if
+// there's none. The image must be released with cache_release().
+const uint8_t *cache_get(cache_t *cache, const cache_key_t *key, size_t *size);
+
+// cache_put() stores a copy of data for key, unless it's larger than the
+// whole cache, and returns the cached copy (to be released with
+// cache_release()) or NULL. If the key is already there the image already
+// cached is returned.
+const uint8_t *cache_put(cache_t *cache, const cache_key_t *key, const uint8_t *data, size_t size);
+
+// cache_retain() takes one more reference to data returned by cache_get()
+// or cache_put(), to be released with cache_release() as well
+void cache_retain(const uint8_t *data);
+
+void cache_release(void *data);
+
+void cache_get_stats(cache_t *cache, cache_stats_t *stats);
+
+#endif /* CACHE_H */
+
+#ifdef CACHE_IMPLEMENTATION
+#ifndef CACHE_IMPLEMENTATION_ONCE
+#define CACHE_IMPLEMENTATION_ONCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* --------------------------------------------------------------------
+ *   MACROS AND CONSTANTS
+ * -------------------------------------------------------------------- */
+
+#define CACHE_BUCKETS 1024		// must be a power of two
+
+/* --------------------------------------------------------------------
+ *   TYPES
+ * -------------------------------------------------------------------- */
+
+typedef struct cache_entry {
+	cache_t *cache;
+	cache_key_t key;
+	uint64_t hash;
+	struct cache_entry *bucket_next;
+	struct cache_entry *lru_prev;	// more recently used
+	struct cache_entry *lru_next;	// less recently used
+	int refs;			// the cache itself holds one while the entry is stored
+	size_t size;
+	uint8_t data[];
+} cache_entry_t;
+
+struct cache {
+	pthread_mutex_t lock;
+	cache_entry_t *buckets[CACHE_BUCKETS];
+	cache_entry_t *lru_head;
+	cache_entry_t *lru_tail;
+	cache_stats_t stats;
+};
+
+/* --------------------------------------------------------------------
+ *   CODE
+ * -------------------------------------------------------------------- */
+
+cache_t *cache_new(size_t capacity)
+{
+	cache_t *cache = (cache_t *)calloc(1, sizeof(cache_t));
+	if (!cache)
+		return NULL;
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->stats.capacity = capacity;
+	return cache;
+}
+
+void cache_key_init(cache_key_t *key, int width, int height, int max_iter,
+		double c_start_re, double c_start_im, double c_end_re, double c_end_im)
+{
+	// no padding garbage in the key, it's hashed and compared as bytes
+	memset(key, 0, sizeof(*key));
+	key->width = width;
+	key->height = height;
+	key->max_iter = max_iter;
+	// + 0.0 turns -0.0 into 0.0
+	key->c_start_re = c_start_re + 0.0;
+	key->c_start_im = c_start_im + 0.0;
+	key->c_end_re = c_end_re + 0.0;
+	key->c_end_im = c_end_im + 0.0;
+}
+
+static uint64_t cache_hash(const cache_key_t *key)
+{
+	// FNV-1a
+	const uint8_t *p = (const uint8_t *)key;
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < sizeof(*key); i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static cache_entry_t *cache_entry_of(const void *data)
+{
+	return (cache_entry_t *)((const uint8_t *)data - offsetof(cache_entry_t, data));
+}
+
+static void cache_lru_unlink(cache_t *cache, cache_entry_t *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void cache_lru_push(cache_t *cache, cache_entry_t *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = entry;
+	else
+		cache->lru_tail = entry;
+	cache->lru_head = entry;
+}
+
+static cache_entry_t *cache_find(cache_t *cache, const cache_key_t *key, uint64_t hash)
+{
+	cache_entry_t *entry = cache->buckets[hash & (CACHE_BUCKETS - 1)];
+	while (entry) {
+		if (entry->hash == hash && memcmp(&entry->key, key, sizeof(*key)) == 0)
+			return entry;
+		entry = entry->bucket_next;
+	}
+	return NULL;
+}
+
+// cache_evict() drops the least recently used entry. Called with the lock held.
+static void cache_evict(cache_t *cache)
+{
+	cache_entry_t *entry = cache->lru_tail;
+	cache_entry_t **link = &cache->buckets[entry->hash & (CACHE_BUCKETS - 1)];
+	while (*link != entry)
+		link = &(*link)->bucket_next;
+	*link = entry->bucket_next;
+	cache_lru_unlink(cache, entry);
+
+	cache->stats.entries--;
+	cache->stats.size -= entry->size;
+	cache->stats.evictions++;
+	// still in use by the responses being sent, if any
+	if (--entry->refs == 0)
+		free(entry);
+}
+
+const uint8_t *cache_get(cache_t *cache, const cache_key_t *key, size_t *size)
+{
+	uint64_t hash = cache_hash(key);
+
+	pthread_mutex_lock(&cache->lock);
+	cache_entry_t *entry = cache_find(cache, key, hash);
+	if (!entry) {
+		cache->stats.misses++;
+		pthread_mutex_unlock(&cache->lock);
+		return NULL;
+	}
+	cache->stats.hits++;
+	cache_lru_unlink(cache, entry);
+	cache_lru_push(cache, entry);
+	entry->refs++;
+	pthread_mutex_unlock(&cache->lock);
+
+	*size = entry->size;
+	return entry->data;
+}
+
+const uint8_t *cache_put(cache_t *cache, const cache_key_t *key, const uint8_t *data, size_t size)
+{
+	if (size > cache->stats.capacity)
+		return NULL;
+
+	// copied before taking the lock
+	cache_entry_t *entry = (cache_entry_t *)malloc(sizeof(cache_entry_t) + size);
+	if (!entry)
+		return NULL;
+	entry->cache = cache;
+	entry->key = *key;
+	entry->hash = cache_hash(key);
+	entry->refs = 2;		// the cache's and the caller's
+	entry->size = size;
+	memcpy(entry->data, data, size);
+
+	pthread_mutex_lock(&cache->lock);
+	cache_entry_t *found = cache_find(cache, key, entry->hash);
+	if (found) {
+		// rendered by someone else in the meantime
+		found->refs++;
+		pthread_mutex_unlock(&cache->lock);
+		free(entry);
+		return found->data;
+	}
+	while (cache->stats.size + size > cache->stats.capacity)
+		cache_evict(cache);
+
+	cache_entry_t **bucket = &cache->buckets[entry->hash & (CACHE_BUCKETS - 1)];
+	entry->bucket_next = *bucket;
+	*bucket = entry;
+	cache_lru_push(cache, entry);
+	cache->stats.entries++;
+	cache->stats.size += size;
+	pthread_mutex_unlock(&cache->lock);
+
+	return entry->data;
+}
+
+void cache_retain(const uint8_t *data)
+{
+	cache_entry_t *entry = cache_entry_of(data);
+	cache_t *cache = entry->cache;
+
+	pthread_mutex_lock(&cache->lock);
+	entry->refs++;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_release(void *data)
+{
+	cache_entry_t *entry = cache_entry_of(data);
+	cache_t *cache = entry->cache;
+
+	pthread_mutex_lock(&cache->lock);
+	int refs = --entry->refs;
+	pthread_mutex_unlock(&cache->lock);
+	if (refs == 0)
+		free(entry);
+}
+
+void cache_get_stats(cache_t *cache, cache_stats_t *stats)
+{
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+#endif /* CACHE_IMPLEMENTATION_ONCE */
+#endif /* CACHE_IMPLEMENTATION */
@@ -67,7 +67,8 @@
 *
 *     HTTP_MAX_TOTAL_EST_MEM_USAGE - default 4294967296 (4GB) - This is the
 *       amount of read/write buffer space that is allowed to be allocated across
-*       all requests before new requests will get 503 responses.
+*       all requests before new requests will get 503 responses, after which
+*       their connections are closed.
 *
 *     HTTP_MAX_TOKEN_LENGTH - default 8192 (8KB) - This is the max size of any
 *       non body http tokens. i.e: header names, header values, url length, etc.
@@ -77,6 +78,22 @@
 *       request + headers cannot fit in this size the request body will be
 *       streamed in.
 *
+*     HTTP_MAX_EVENTS - default 64 - The maximum number of events handled by
+*       the event loop at each wake up.
+*
+*     HTTP_TIMER_WHEEL_SLOTS - default 128 - The number of slots of the wheel
+*       keeping the request timeouts, one second each. Timeouts longer than
+*       this still work but take more than one turn of the wheel.
+*
+*     HTTP_POOL_MAX_SESSIONS - default 1024 - The number of closed sessions
+*       that each event loop keeps for reuse by the next connections.
+*
+*     HTTP_POOL_MAX_MEM - default 67108864 (64MB) - The amount of request and
+*       response buffer space that each event loop keeps for reuse once the
+*       buffers are released. Buffers are pooled in power of two sizes from
+*       HTTP_REQUEST_BUF_SIZE to HTTP_MAX_REQUEST_BUF_SIZE. Pooled memory is
+*       counted against HTTP_MAX_TOTAL_EST_MEM_USAGE.
+*
 *   For more details see the documentation of the interface and the example
 *   below.
 *
@@ -100,7 +117,9 @@ struct http_server_s;
 struct http_request_s;
 struct http_response_s;
 
-// Returns the event loop id that the server is running on. This will be an
+// Returns the event loop id that the server is running on. For a server with
+// several reactor threads (see http_server_init_threads) this is the loop of
+// the thread that called http_server_listen. This will be an
 // epoll fd when running on Linux or a kqueue on BSD. This can be used to
 // listen for activity on sockets, etc. The only caveat is that the user data
 // must be set to a struct where the first member is the function pointer to
@@ -129,11 +148,25 @@ int http_server_loop(struct http_server_s* server);
 // pointer that is called to process requests.
 struct http_server_s* http_server_init(int port, void (*handler)(struct http_request_s*));
 
+// Like http_server_init but the server runs `threads` reactors, each one on
+// its own thread with its own listening socket (bound to the same port with
+// SO_REUSEPORT, so that the kernel spreads the connections among them), event
+// loop and memory accounting. The handler is called on the thread of the
+// reactor that accepted the connection and must be thread safe. The calling
+// thread becomes the first reactor when http_server_listen is called. Only
+// http_server_listen and http_server_listen_addr start the extra reactors, the
+// polling variants run the first one only.
+struct http_server_s* http_server_init_threads(int port, void (*handler)(struct http_request_s*), int threads);
+
 // Stores a pointer for future retrieval. This is not used by the library in
 // any way and is strictly for you, the application programmer to make use
 // of.
 void http_server_set_userdata(struct http_server_s* server, void* data);
 
+// Starts `threads` offload threads, shared by all the reactors of the server,
+// to run the work handed over with http_request_offload.
+void http_server_set_offload_threads(struct http_server_s* server, int threads);
+
 // Starts the event loop and the server listening. During normal operation this
 // function will not return. Return value is the error code if the server fails
 // to start. By default it will listen on all interface. For the second variant
@@ -237,10 +270,43 @@ void http_response_header(struct http_response_s* response, char const * key, ch
 // http_respond has been called.
 void http_response_body(struct http_response_s* response, char const * body, int length);
 
+// Like http_response_body but the body isn't copied into the response buffer:
+// it's written to the socket straight from `body`, after the headers, so it
+// must stay valid until the response has been sent. Then, or when the
+// connection is closed before, free_body(body) is called on the loop thread.
+// Pass NULL as free_body for memory that doesn't need to be freed. Chunked
+// responses still copy the body, and free it right away.
+void http_response_body_owned(
+  struct http_response_s* response,
+  char const * body,
+  int length,
+  void (*free_body)(void*)
+);
+
 // Starts writing the response to the client. Any memory allocated for the
-// response body or response headers is safe to free after this call.
+// response body or response headers is safe to free after this call. It must
+// be called from within the request handler, see http_respond_async to answer
+// after the handler has returned.
 void http_respond(struct http_request_s* request, struct http_response_s* response);
 
+// Thread safe variant of http_respond. It can be called from any thread, also
+// after the request handler has returned: the response is queued and written
+// by the loop that owns the request, which gets woken up if needed. Until
+// then the request timeout is suspended. The response body is copied (unless
+// set with http_response_body_owned), so its memory is safe to free after this
+// call, but the header keys and values are not: they must stay valid until the
+// response is written (string literals are fine).
+void http_respond_async(struct http_request_s* request, struct http_response_s* response);
+
+// Hands the request over to one of the offload threads of the server (see
+// http_server_set_offload_threads), that will call work(request), so that the
+// loop can keep serving the other connections while the request is being
+// processed. The work function must answer with http_respond_async, and must
+// not call the functions that change the request (like
+// http_request_free_buffer) since the request buffers belong to the loop. If
+// the server has no offload threads work is called right away.
+void http_request_offload(struct http_request_s* request, void (*work)(struct http_request_s*));
+
 // Writes a chunk to the client. The notify_done callback will be called when
 // the write is complete. This call consumes the response so a new response
 // will need to be initialized for each chunk. The response status of the
@@ -328,8 +394,11 @@ int main() {
 #include <signal.h>
 #include <limits.h>
 #include <assert.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 #ifdef KQUEUE
@@ -337,6 +406,7 @@ int main() {
 #else
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #endif
 
 // *** macro definitions
@@ -349,6 +419,10 @@ int main() {
 #define HTTP_MAX_TOKEN_LENGTH 8192 // 8kb
 #define HTTP_MAX_TOTAL_EST_MEM_USAGE 4294967296 // 4gb
 #define HTTP_MAX_REQUEST_BUF_SIZE 8388608 // 8mb
+#define HTTP_MAX_EVENTS 64 // events handled per loop wakeup
+#define HTTP_TIMER_WHEEL_SLOTS 128 // 1 second each
+#define HTTP_POOL_MAX_SESSIONS 1024
+#define HTTP_POOL_MAX_MEM 67108864 // 64mb
 
 #define HTTP_MAX_HEADER_COUNT 127
 
@@ -395,6 +469,7 @@ typedef struct {
   http_token_t* buf;
   int capacity;
   int size;
+  int64_t* memused;
 } http_token_dyn_t;
 
 #ifdef EPOLL
@@ -434,8 +509,6 @@ typedef struct http_request_s {
   void (*handler)(struct kevent* ev);
 #else
   epoll_cb_t handler;
-  epoll_cb_t timer_handler;
-  int timerfd;
 #endif
   void (*chunk_cb)(struct http_request_s*);
   void* data;
@@ -443,28 +516,81 @@ typedef struct http_request_s {
   http_parser_t parser;
   int state;
   int socket;
-  int timeout;
+  int timeout; // turns of the timer wheel left before the timer expires
+  int timer_slot; // -1 when the timer is not armed
+  struct http_request_s* timer_next;
+  struct http_request_s* timer_prev;
   struct http_server_s* server;
+  struct http_request_s* next_closed;
+  // body of the response being written, after the headers in the stream
+  char const * body;
+  int body_length;
+  void (*free_body)(void*);
   http_token_dyn_t tokens;
   char flags;
 } http_request_t;
 
+// Free buffers of one of the pool size classes are linked through their first
+// bytes.
+typedef struct hs_pool_buf_s {
+  struct hs_pool_buf_s* next;
+} hs_pool_buf_t;
+
+// HTTP_REQUEST_BUF_SIZE << (HS_BUF_CLASSES - 1) == HTTP_MAX_REQUEST_BUF_SIZE
+#define HS_BUF_CLASSES 14
+
+// response queued by http_respond_async
+typedef struct hs_completion_s {
+  struct http_request_s* request;
+  struct http_response_s* response;
+  char* body;
+  struct hs_completion_s* next;
+} hs_completion_t;
+
+// request queued by http_request_offload
+typedef struct hs_job_s {
+  struct http_request_s* request;
+  void (*work)(struct http_request_s*);
+  struct hs_job_s* next;
+} hs_job_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  hs_job_t* head;
+  hs_job_t* tail;
+} hs_offload_t;
+
 typedef struct http_server_s {
 #ifdef KQUEUE
   void (*handler)(struct kevent* ev);
 #else
   epoll_cb_t handler;
   epoll_cb_t timer_handler;
+  epoll_cb_t completion_handler;
+  int completionfd;
 #endif
+  pthread_mutex_t completion_lock;
+  hs_completion_t* completions;
+  hs_completion_t* completions_tail;
+  hs_offload_t* offload;
   int64_t memused;
   int socket;
   int port;
   int loop;
   int timerfd;
+  int timer_tick;
+  http_request_t* timers[HTTP_TIMER_WHEEL_SLOTS];
   socklen_t len;
+  int threads;
   void (*request_handler)(http_request_t*);
   struct sockaddr_in addr;
   void* data;
+  http_request_t* closed;
+  http_request_t* session_pool;
+  int sessions_pooled;
+  hs_pool_buf_t* buf_pool[HS_BUF_CLASSES];
+  int64_t buf_pooled;
   char date[32];
 } http_server_t;
 
@@ -479,6 +605,8 @@ typedef struct http_response_s {
   char const * body;
   int content_length;
   int status;
+  char body_owned;
+  void (*free_body)(void*);
 } http_response_t;
 
 typedef struct http_string_s http_string_t;
@@ -522,9 +650,11 @@ enum hs_meta_type {
 
 void hs_add_server_sock_events(struct http_server_s* serv);
 void hs_server_init(struct http_server_s* serv);
+void hs_server_run(struct http_server_s* serv);
 void hs_delete_events(struct http_request_s* request);
 void hs_add_events(struct http_request_s* request);
 void hs_add_write_event(struct http_request_s* request);
+void hs_wake_loop(struct http_server_s* serv);
 void hs_process_tokens(http_request_t* request);
 
 #ifdef KQUEUE
@@ -537,7 +667,7 @@ void hs_session_io_cb(struct kevent* ev);
 void hs_server_listen_cb(struct epoll_event* ev);
 void hs_session_io_cb(struct epoll_event* ev);
 void hs_server_timer_cb(struct epoll_event* ev);
-void hs_request_timer_cb(struct epoll_event* ev);
+void hs_server_completion_cb(struct epoll_event* ev);
 
 #endif
 
@@ -722,12 +852,13 @@ static int const hs_token_start_states[] = {
 
 // *** input stream ***
 
-int hs_stream_read_socket(hs_stream_t* stream, int socket, int64_t* memused) {
+char* hs_buf_alloc(struct http_server_s* server, int64_t capacity);
+char* hs_buf_realloc(struct http_server_s* server, char* buf, int64_t size, int64_t capacity, int64_t new_capacity);
+
+int hs_stream_read_socket(hs_stream_t* stream, int socket, struct http_server_s* server) {
   if (stream->index < stream->length) return 1;
   if (!stream->buf) {
-    *memused += HTTP_REQUEST_BUF_SIZE;
-    stream->buf = (char*)calloc(1, HTTP_REQUEST_BUF_SIZE);
-    assert(stream->buf != NULL);
+    stream->buf = hs_buf_alloc(server, HTTP_REQUEST_BUF_SIZE);
     stream->capacity = HTTP_REQUEST_BUF_SIZE;
   }
   int bytes;
@@ -745,14 +876,12 @@ int hs_stream_read_socket(hs_stream_t* stream, int socket, int64_t* memused) {
       stream->length == stream->capacity &&
       stream->capacity != HTTP_MAX_REQUEST_BUF_SIZE
     ) {
-      *memused -= stream->capacity;
-      stream->capacity *= 2;
-      if (stream->capacity > HTTP_MAX_REQUEST_BUF_SIZE) {
-        stream->capacity = HTTP_MAX_REQUEST_BUF_SIZE;
+      int32_t capacity = stream->capacity * 2;
+      if (capacity > HTTP_MAX_REQUEST_BUF_SIZE) {
+        capacity = HTTP_MAX_REQUEST_BUF_SIZE;
       }
-      *memused += stream->capacity;
-      stream->buf = (char*)realloc(stream->buf, stream->capacity);
-      assert(stream->buf != NULL);
+      stream->buf = hs_buf_realloc(server, stream->buf, stream->length, stream->capacity, capacity);
+      stream->capacity = capacity;
     }
   } while (bytes > 0 && stream->capacity < HTTP_MAX_REQUEST_BUF_SIZE);
   return bytes == 0 ? 0 : 1;
@@ -997,6 +1126,7 @@ http_token_t http_parse(http_parser_t* parser, hs_stream_t* stream) {
 
 void http_token_dyn_push(http_token_dyn_t* dyn, http_token_t a) {
   if (dyn->size == dyn->capacity) {
+    *dyn->memused += dyn->capacity * sizeof(http_token_t);
     dyn->capacity *= 2;
     dyn->buf = (http_token_t*)realloc(dyn->buf, dyn->capacity * sizeof(http_token_t));
     assert(dyn->buf != NULL);
@@ -1005,11 +1135,13 @@ void http_token_dyn_push(http_token_dyn_t* dyn, http_token_t a) {
   dyn->size++;
 }
 
-void http_token_dyn_init(http_token_dyn_t* dyn, int capacity) {
+void http_token_dyn_init(http_token_dyn_t* dyn, int capacity, int64_t* memused) {
   dyn->buf = (http_token_t*)malloc(sizeof(http_token_t) * capacity);
   assert(dyn->buf != NULL);
   dyn->size = 0;
   dyn->capacity = capacity;
+  dyn->memused = memused;
+  *dyn->memused += dyn->capacity * sizeof(http_token_t);
 }
 
 void hs_bind_localhost(int s, struct sockaddr_in* addr, const char* ipaddr, int port) {
@@ -1027,19 +1159,105 @@ void hs_bind_localhost(int s, struct sockaddr_in* addr, const char* ipaddr, int
 }
 
 int hs_write_client_socket(http_request_t* session) {
-  int bytes = write(
-    session->socket,
-    session->stream.buf + session->stream.total_bytes,
-    session->stream.length - session->stream.total_bytes
-  );
+  ssize_t bytes;
+  if (session->body) {
+    // The stream holds the headers, the body comes from the application.
+    // total_bytes counts the bytes written from both.
+    struct iovec iov[2];
+    int iovcnt = 0;
+    int64_t offset = session->stream.total_bytes;
+    if (offset < session->stream.length) {
+      iov[iovcnt].iov_base = session->stream.buf + offset;
+      iov[iovcnt].iov_len = session->stream.length - offset;
+      iovcnt++;
+      offset = 0;
+    } else {
+      offset -= session->stream.length;
+    }
+    iov[iovcnt].iov_base = (char*)session->body + offset;
+    iov[iovcnt].iov_len = session->body_length - offset;
+    iovcnt++;
+    bytes = writev(session->socket, iov, iovcnt);
+  } else {
+    bytes = write(
+      session->socket,
+      session->stream.buf + session->stream.total_bytes,
+      session->stream.length - session->stream.total_bytes
+    );
+  }
   if (bytes > 0) session->stream.total_bytes += bytes;
   return errno == EPIPE ? 0 : 1;
 }
 
+void hs_release_body(http_request_t* session) {
+  if (session->body && session->free_body) {
+    session->free_body((void*)session->body);
+  }
+  session->body = NULL;
+  session->body_length = 0;
+  session->free_body = NULL;
+}
+
+// Each event loop keeps the buffers it releases, up to HTTP_POOL_MAX_MEM
+// bytes, in lists of power of two size classes. Buffers of other sizes are
+// just allocated and freed. All of them are counted in memused until they're
+// freed. The pool is only touched from the loop thread, so it needs no locks.
+
+int hs_buf_class(int64_t capacity) {
+  int64_t size = HTTP_REQUEST_BUF_SIZE;
+  for (int i = 0; i < HS_BUF_CLASSES; i++, size *= 2) {
+    if (size == capacity) return i;
+  }
+  return -1;
+}
+
+// Rounds a buffer size up to the size class that fits it, if any.
+int64_t hs_buf_size(int64_t size) {
+  int64_t capacity = HTTP_REQUEST_BUF_SIZE;
+  for (int i = 0; i < HS_BUF_CLASSES; i++, capacity *= 2) {
+    if (size <= capacity) return capacity;
+  }
+  return size;
+}
+
+char* hs_buf_alloc(http_server_t* server, int64_t capacity) {
+  int i = hs_buf_class(capacity);
+  if (i >= 0 && server->buf_pool[i]) {
+    hs_pool_buf_t* buf = server->buf_pool[i];
+    server->buf_pool[i] = buf->next;
+    server->buf_pooled -= capacity;
+    return (char*)buf;
+  }
+  char* buf = (char*)malloc(capacity);
+  assert(buf != NULL);
+  server->memused += capacity;
+  return buf;
+}
+
+void hs_buf_free(http_server_t* server, char* buf, int64_t capacity) {
+  int i = hs_buf_class(capacity);
+  if (i >= 0 && server->buf_pooled + capacity <= HTTP_POOL_MAX_MEM) {
+    hs_pool_buf_t* pool_buf = (hs_pool_buf_t*)buf;
+    pool_buf->next = server->buf_pool[i];
+    server->buf_pool[i] = pool_buf;
+    server->buf_pooled += capacity;
+    return;
+  }
+  free(buf);
+  server->memused -= capacity;
+}
+
+// Moves the first `size` bytes of buf to a buffer of new_capacity bytes.
+char* hs_buf_realloc(http_server_t* server, char* buf, int64_t size, int64_t capacity, int64_t new_capacity) {
+  char* new_buf = hs_buf_alloc(server, new_capacity);
+  memcpy(new_buf, buf, size);
+  hs_buf_free(server, buf, capacity);
+  return new_buf;
+}
+
 void hs_free_buffer(http_request_t* session) {
   if (session->stream.buf) {
-    free(session->stream.buf);
-    session->server->memused -= session->stream.capacity;
+    hs_buf_free(session->server, session->stream.buf, session->stream.capacity);
     session->stream.buf = NULL;
   }
 }
@@ -1048,24 +1266,129 @@ void hs_init_session(http_request_t* session) {
   session->flags = HTTP_AUTOMATIC;
   session->parser = (http_parser_t){ };
   session->stream = (hs_stream_t){ };
+  // the token array is kept from one request (and session) to the next
   if (session->tokens.buf) {
+    session->tokens.size = 0;
+  } else {
+    http_token_dyn_init(&session->tokens, 32, &session->server->memused);
+  }
+}
+
+// Closed sessions, together with their token arrays, are kept for the next
+// connections, up to HTTP_POOL_MAX_SESSIONS for each event loop.
+http_request_t* hs_session_alloc(http_server_t* server) {
+  http_request_t* session = server->session_pool;
+  if (session) {
+    server->session_pool = session->next_closed;
+    server->sessions_pooled--;
+    http_token_dyn_t tokens = session->tokens;
+    memset(session, 0, sizeof(http_request_t));
+    session->tokens = tokens;
+    return session;
+  }
+  session = (http_request_t*)calloc(1, sizeof(http_request_t));
+  assert(session != NULL);
+  server->memused += sizeof(http_request_t);
+  return session;
+}
+
+void hs_session_free(http_server_t* server, http_request_t* session) {
+  if (server->sessions_pooled < HTTP_POOL_MAX_SESSIONS) {
+    session->next_closed = server->session_pool;
+    server->session_pool = session;
+    server->sessions_pooled++;
+    return;
+  }
+  if (session->tokens.buf) {
+    server->memused -= session->tokens.capacity * sizeof(http_token_t);
     free(session->tokens.buf);
-    session->tokens.buf = NULL;
   }
-  http_token_dyn_init(&session->tokens, 32);
+  server->memused -= sizeof(http_request_t);
+  free(session);
+}
+
+#ifdef KQUEUE
+void hs_closed_session_cb(struct kevent* ev) {
+#else
+void hs_closed_session_cb(struct epoll_event* ev) {
+#endif
+  (void)ev;
+}
+
+// Sessions are freed only once the loop is done with the current batch of
+// events, which may still point to them.
+void hs_free_closed_sessions(http_server_t* server) {
+  while (server->closed) {
+    http_request_t* session = server->closed;
+    server->closed = session->next_closed;
+    hs_session_free(server, session);
+  }
+}
+
+// The request timers live in a wheel of HTTP_TIMER_WHEEL_SLOTS lists, one for
+// each tick (second) of the server timer: arming, resetting or cancelling a
+// timer is just a list insertion or removal, and every tick only looks at the
+// requests that expire in that second. Longer timeouts go around the wheel
+// more than once.
+
+void hs_timer_link(http_request_t* request, int slot) {
+  http_server_t* server = request->server;
+  request->timer_slot = slot;
+  request->timer_prev = NULL;
+  request->timer_next = server->timers[slot];
+  if (request->timer_next) request->timer_next->timer_prev = request;
+  server->timers[slot] = request;
+}
+
+void hs_timer_cancel(http_request_t* request) {
+  if (request->timer_slot < 0) return;
+  if (request->timer_prev) {
+    request->timer_prev->timer_next = request->timer_next;
+  } else {
+    request->server->timers[request->timer_slot] = request->timer_next;
+  }
+  if (request->timer_next) request->timer_next->timer_prev = request->timer_prev;
+  request->timer_next = NULL;
+  request->timer_prev = NULL;
+  request->timer_slot = -1;
+}
+
+// Ends the session after `time` seconds, unless reset or cancelled before.
+void hs_reset_timeout(http_request_t* request, int time) {
+  hs_timer_cancel(request);
+  if (time < 1) time = 1;
+  request->timeout = (time - 1) / HTTP_TIMER_WHEEL_SLOTS;
+  hs_timer_link(request, (request->server->timer_tick + time) % HTTP_TIMER_WHEEL_SLOTS);
 }
 
 void hs_end_session(http_request_t* session) {
+  hs_timer_cancel(session);
   hs_delete_events(session);
   close(session->socket);
   hs_free_buffer(session);
-  free(session->tokens.buf);
-  session->tokens.buf = NULL;
-  free(session);
-}
-
-void hs_reset_timeout(http_request_t* request, int time) {
-  request->timeout = time;
+  hs_release_body(session);
+  session->handler = hs_closed_session_cb;
+  session->next_closed = session->server->closed;
+  session->server->closed = session;
+}
+
+// Called by the server timer every second.
+void hs_timer_tick(http_server_t* server) {
+  int slot = (server->timer_tick + 1) % HTTP_TIMER_WHEEL_SLOTS;
+  server->timer_tick = slot;
+  http_request_t* request = server->timers[slot];
+  server->timers[slot] = NULL;
+  while (request) {
+    http_request_t* next = request->timer_next;
+    if (request->timeout > 0) {
+      request->timeout -= 1;
+      hs_timer_link(request, slot);
+    } else {
+      request->timer_slot = -1;
+      hs_end_session(request);
+    }
+    request = next;
+  }
 }
 
 void hs_read_and_process_request(http_request_t* request);
@@ -1075,13 +1398,14 @@ void hs_write_response(http_request_t* request) {
     HTTP_FLAG_SET(request->flags, HTTP_END_SESSION);
     return;
   }
-  if (request->stream.total_bytes != request->stream.length) {
+  if (request->stream.total_bytes != request->stream.length + request->body_length) {
     // All bytes of the body were not written and we need to wait until the
     // socket is writable again to complete the write
     hs_add_write_event(request);
     request->state = HTTP_SESSION_WRITE;
     hs_reset_timeout(request, HTTP_REQUEST_TIMEOUT);
   } else if (HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE)) {
+    hs_release_body(request);
     // All bytes of the chunk were written and we need to get the next chunk
     // from the application.
     request->state = HTTP_SESSION_WRITE;
@@ -1089,6 +1413,7 @@ void hs_write_response(http_request_t* request) {
     hs_free_buffer(request);
     request->chunk_cb(request);
   } else {
+    hs_release_body(request);
     if (HTTP_FLAG_CHECK(request->flags, HTTP_KEEP_ALIVE)) {
       request->state = HTTP_SESSION_INIT;
       hs_free_buffer(request);
@@ -1112,7 +1437,7 @@ void hs_read_and_process_request(http_request_t* request) {
   request->state = HTTP_SESSION_READ;
   http_token_t token = {0, 0, 0};
   hs_reset_timeout(request, HTTP_REQUEST_TIMEOUT);
-  int rc = hs_stream_read_socket(&request->stream, request->socket, &request->server->memused);
+  int rc = hs_stream_read_socket(&request->stream, request->socket, request->server);
   if (rc == 0) {
     HTTP_FLAG_SET(request->flags, HTTP_END_SESSION);
     return;
@@ -1129,10 +1454,13 @@ void hs_read_and_process_request(http_request_t* request) {
         if (token.type == HS_TOK_BODY_STREAM) {
           HTTP_FLAG_SET(request->flags, HTTP_FLG_STREAMED);
         }
+        // the application owns the request until it responds
+        hs_timer_cancel(request);
         request->state = HTTP_SESSION_NOP;
         request->server->request_handler(request);
         break;
       case HS_TOK_CHUNK_BODY:
+        hs_timer_cancel(request);
         request->state = HTTP_SESSION_NOP;
         request->chunk_cb(request);
         break;
@@ -1157,6 +1485,9 @@ void http_session(http_request_t* request) {
       hs_init_session(request);
       request->state = HTTP_SESSION_READ;
       if (request->server->memused > HTTP_MAX_TOTAL_EST_MEM_USAGE) {
+        // The request is left unread on the socket, so the connection can't
+        // be reused: it's closed once the 503 is written.
+        http_request_connection(request, HTTP_CLOSE);
         return hs_error_response(request, 503, "Service Unavailable");
       }
       // fallthrough
@@ -1177,11 +1508,11 @@ void hs_accept_connections(http_server_t* server) {
   do {
     sock = accept(server->socket, (struct sockaddr *)&server->addr, &server->len);
     if (sock > 0) {
-      http_request_t* session = (http_request_t*)calloc(1, sizeof(http_request_t));
-      assert(session != NULL);
+      http_request_t* session = hs_session_alloc(server);
       session->socket = sock;
       session->server = server;
-      session->timeout = HTTP_REQUEST_TIMEOUT;
+      session->timer_slot = -1;
+      hs_reset_timeout(session, HTTP_REQUEST_TIMEOUT);
       session->handler = hs_session_io_cb;
       int flags = fcntl(sock, F_GETFL, 0);
       fcntl(sock, F_SETFL, flags | O_NONBLOCK);
@@ -1193,26 +1524,73 @@ void hs_accept_connections(http_server_t* server) {
 
 void hs_generate_date_time(char* datetime) {
   time_t rawtime;
-  struct tm * timeinfo;
+  struct tm timeinfo;
   time(&rawtime);
-  timeinfo = gmtime(&rawtime);
-  strftime(datetime, 32, "%a, %d %b %Y %T GMT", timeinfo);
+  gmtime_r(&rawtime, &timeinfo);
+  strftime(datetime, 32, "%a, %d %b %Y %T GMT", &timeinfo);
 }
 
 http_server_t* http_server_init(int port, void (*handler)(http_request_t*)) {
-  http_server_t* serv = (http_server_t*)malloc(sizeof(http_server_t));
+  return http_server_init_threads(port, handler, 1);
+}
+
+// The reactors are allocated as one array, the first one is the server handle
+// returned to the application.
+http_server_t* http_server_init_threads(int port, void (*handler)(http_request_t*), int threads) {
+  if (threads < 1) threads = 1;
+  http_server_t* serv = (http_server_t*)calloc(threads, sizeof(http_server_t));
   assert(serv != NULL);
-  serv->port = port;
-  serv->memused = 0;
-  serv->handler = hs_server_listen_cb;
-  hs_server_init(serv);
-  hs_generate_date_time(serv->date);
-  serv->request_handler = handler;
+  for (int i = 0; i < threads; i++) {
+    serv[i].port = port;
+    serv[i].memused = 0;
+    serv[i].threads = threads;
+    serv[i].handler = hs_server_listen_cb;
+    pthread_mutex_init(&serv[i].completion_lock, NULL);
+    hs_server_init(&serv[i]);
+    hs_generate_date_time(serv[i].date);
+    serv[i].request_handler = handler;
+  }
   return serv;
 }
 
 void http_server_set_userdata(struct http_server_s* serv, void* data) {
-  serv->data = data;
+  for (int i = 0; i < serv->threads; i++) {
+    serv[i].data = data;
+  }
+}
+
+void* hs_offload_thread(void* data) {
+  hs_offload_t* offload = (hs_offload_t*)data;
+  while (1) {
+    pthread_mutex_lock(&offload->lock);
+    while (offload->head == NULL) {
+      pthread_cond_wait(&offload->cond, &offload->lock);
+    }
+    hs_job_t* job = offload->head;
+    offload->head = job->next;
+    if (offload->head == NULL) offload->tail = NULL;
+    pthread_mutex_unlock(&offload->lock);
+    job->work(job->request);
+    free(job);
+  }
+  return NULL;
+}
+
+void http_server_set_offload_threads(struct http_server_s* serv, int threads) {
+  hs_offload_t* offload = (hs_offload_t*)calloc(1, sizeof(hs_offload_t));
+  assert(offload != NULL);
+  pthread_mutex_init(&offload->lock, NULL);
+  pthread_cond_init(&offload->cond, NULL);
+  for (int i = 0; i < threads; i++) {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, hs_offload_thread, offload);
+    assert(rc == 0);
+    (void)rc; // suppress warning
+    pthread_detach(thread);
+  }
+  for (int i = 0; i < serv->threads; i++) {
+    serv[i].offload = offload;
+  }
 }
 
 void http_listen(http_server_t* serv, const char* ipaddr) {
@@ -1242,6 +1620,29 @@ int http_server_loop(http_server_t* server) {
   return server->loop;
 }
 
+void* hs_reactor_thread(void* data) {
+  hs_server_run((http_server_t*)data);
+  return NULL;
+}
+
+int http_server_listen_addr(http_server_t* serv, const char* ipaddr) {
+  for (int i = 0; i < serv->threads; i++) {
+    http_listen(&serv[i], ipaddr);
+  }
+  for (int i = 1; i < serv->threads; i++) {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, hs_reactor_thread, &serv[i]);
+    if (rc != 0) return rc;
+    pthread_detach(thread);
+  }
+  hs_server_run(serv);
+  return 0;
+}
+
+int http_server_listen(http_server_t* serv) {
+  return http_server_listen_addr(serv, NULL);
+}
+
 // *** http request ***
 
 http_string_t http_get_token_string(http_request_t* request, int token_type) {
@@ -1418,49 +1819,66 @@ void http_response_body(http_response_t* response, char const * body, int length
   response->content_length = length;
 }
 
+void http_response_body_owned(
+  http_response_t* response,
+  char const * body,
+  int length,
+  void (*free_body)(void*)
+) {
+  response->body = body;
+  response->content_length = length;
+  response->body_owned = 1;
+  response->free_body = free_body;
+}
+
+// Frees a body set with http_response_body_owned once it has been copied.
+void hs_response_free_body(http_response_t* response) {
+  if (response->body_owned && response->body && response->free_body) {
+    response->free_body((void*)response->body);
+  }
+}
+
 typedef struct {
   char* buf;
   int capacity;
   int size;
-  int64_t* memused;
+  http_server_t* server;
 } grwprintf_t;
 
-void grwprintf_init(grwprintf_t* ctx, int capacity, int64_t* memused) {
-  ctx->memused = memused;
+void grwprintf_init(grwprintf_t* ctx, int capacity, http_server_t* server) {
+  ctx->server = server;
   ctx->size = 0;
-  ctx->buf = (char*)malloc(capacity);
-  *ctx->memused += capacity;
-  assert(ctx->buf != NULL);
+  ctx->buf = hs_buf_alloc(server, capacity);
   ctx->capacity = capacity;
 }
 
 void grwmemcpy(grwprintf_t* ctx, char const * src, int size) {
   if (ctx->size + size > ctx->capacity) {
-    *ctx->memused -= ctx->capacity;
-    ctx->capacity = ctx->size + size;
-    *ctx->memused += ctx->capacity;
-    ctx->buf = (char*)realloc(ctx->buf, ctx->capacity);
-    assert(ctx->buf != NULL);
+    int capacity = hs_buf_size(ctx->size + size);
+    ctx->buf = hs_buf_realloc(ctx->server, ctx->buf, ctx->size, ctx->capacity, capacity);
+    ctx->capacity = capacity;
   }
   memcpy(ctx->buf + ctx->size, src, size);
   ctx->size += size;
 }
 
 void grwprintf(grwprintf_t* ctx, char const * fmt, ...) {
-  va_list args;
+  va_list args, retry;
   va_start(args, fmt);
+  va_copy(retry, args);
 
+  // vsnprintf needs room for the terminating null byte
   int bytes = vsnprintf(ctx->buf + ctx->size, ctx->capacity - ctx->size, fmt, args);
-  if (bytes + ctx->size > ctx->capacity) {
-    *ctx->memused -= ctx->capacity;
-    while (bytes + ctx->size > ctx->capacity) ctx->capacity *= 2;
-    *ctx->memused += ctx->capacity;
-    ctx->buf = (char*)realloc(ctx->buf, ctx->capacity);
-    assert(ctx->buf != NULL);
-    bytes += vsnprintf(ctx->buf + ctx->size, ctx->capacity - ctx->size, fmt, args);
+  if (bytes + ctx->size >= ctx->capacity) {
+    int capacity = ctx->capacity;
+    while (bytes + ctx->size >= capacity) capacity *= 2;
+    ctx->buf = hs_buf_realloc(ctx->server, ctx->buf, ctx->size, ctx->capacity, capacity);
+    ctx->capacity = capacity;
+    vsnprintf(ctx->buf + ctx->size, ctx->capacity - ctx->size, fmt, retry);
   }
   ctx->size += bytes;
 
+  va_end(retry);
   va_end(args);
 }
 
@@ -1519,21 +1937,98 @@ void http_end_response(http_request_t* request, http_response_t* response, grwpr
 
 void http_respond(http_request_t* request, http_response_t* response) {
   grwprintf_t printctx;
-  grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &request->server->memused);
+  grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, request->server);
   http_respond_headers(request, response, &printctx);
-  if (response->body) {
+  if (response->body_owned) {
+    // written after the headers by hs_write_client_socket, without copying it
+    request->body = response->body;
+    request->body_length = response->body ? response->content_length : 0;
+    request->free_body = response->free_body;
+  } else if (response->body) {
     grwmemcpy(&printctx, response->body, response->content_length);
   }
   http_end_response(request, response, &printctx);
 }
 
+void http_respond_async(http_request_t* request, http_response_t* response) {
+  hs_completion_t* completion = (hs_completion_t*)malloc(sizeof(hs_completion_t));
+  assert(completion != NULL);
+  completion->request = request;
+  completion->response = response;
+  completion->body = NULL;
+  completion->next = NULL;
+  if (response->body && !response->body_owned) {
+    completion->body = (char*)malloc(response->content_length);
+    assert(completion->body != NULL);
+    memcpy(completion->body, response->body, response->content_length);
+    response->body = completion->body;
+  }
+  http_server_t* server = request->server;
+  pthread_mutex_lock(&server->completion_lock);
+  if (server->completions_tail) {
+    server->completions_tail->next = completion;
+  } else {
+    server->completions = completion;
+  }
+  server->completions_tail = completion;
+  pthread_mutex_unlock(&server->completion_lock);
+  hs_wake_loop(server);
+}
+
+// Called on the loop thread to write the responses queued by
+// http_respond_async.
+void hs_process_completions(http_server_t* server) {
+  pthread_mutex_lock(&server->completion_lock);
+  hs_completion_t* completion = server->completions;
+  server->completions = NULL;
+  server->completions_tail = NULL;
+  pthread_mutex_unlock(&server->completion_lock);
+  while (completion) {
+    hs_completion_t* next = completion->next;
+    http_request_t* request = completion->request;
+    http_respond(request, completion->response);
+    // Socket events were ignored while the application owned the request, so
+    // close the session or look for the next request here.
+    if (HTTP_FLAG_CHECK(request->flags, HTTP_END_SESSION)) {
+      hs_end_session(request);
+    } else if (request->state == HTTP_SESSION_INIT) {
+      http_session(request);
+    }
+    free(completion->body);
+    free(completion);
+    completion = next;
+  }
+}
+
+void http_request_offload(http_request_t* request, void (*work)(http_request_t*)) {
+  hs_offload_t* offload = request->server->offload;
+  if (offload == NULL) {
+    work(request);
+    return;
+  }
+  hs_job_t* job = (hs_job_t*)malloc(sizeof(hs_job_t));
+  assert(job != NULL);
+  job->request = request;
+  job->work = work;
+  job->next = NULL;
+  pthread_mutex_lock(&offload->lock);
+  if (offload->tail) {
+    offload->tail->next = job;
+  } else {
+    offload->head = job;
+  }
+  offload->tail = job;
+  pthread_cond_signal(&offload->cond);
+  pthread_mutex_unlock(&offload->lock);
+}
+
 void http_respond_chunk(
   http_request_t* request,
   http_response_t* response,
   void (*cb)(http_request_t*)
 ) {
   grwprintf_t printctx;
-  grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &request->server->memused);
+  grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, request->server);
   if (!HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE)) {
     HTTP_FLAG_SET(request->flags, HTTP_CHUNKED_RESPONSE);
     http_response_header(response, "Transfer-Encoding", "chunked");
@@ -1542,13 +2037,14 @@ void http_respond_chunk(
   request->chunk_cb = cb;
   grwprintf(&printctx, "%X\r\n", response->content_length);
   grwmemcpy(&printctx, response->body, response->content_length);
+  hs_response_free_body(response);
   grwprintf(&printctx, "\r\n");
   http_end_response(request, response, &printctx);
 }
 
 void http_respond_chunk_end(http_request_t* request, http_response_t* response) {
   grwprintf_t printctx;
-  grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &request->server->memused);
+  grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, request->server);
   grwprintf(&printctx, "0\r\n");
   http_buffer_headers(request, response, &printctx);
   grwprintf(&printctx, "\r\n");
@@ -1564,19 +2060,16 @@ void hs_server_listen_cb(struct kevent* ev) {
   http_server_t* server = (http_server_t*)ev->udata;
   if (ev->filter == EVFILT_TIMER) {
     hs_generate_date_time(server->date);
+    hs_timer_tick(server);
+  } else if (ev->filter == EVFILT_USER) {
+    hs_process_completions(server);
   } else {
     hs_accept_connections(server);
   }
 }
 
 void hs_session_io_cb(struct kevent* ev) {
-  http_request_t* request = (http_request_t*)ev->udata;
-  if (ev->filter == EVFILT_TIMER) {
-    request->timeout -= 1;
-    if (request->timeout == 0) hs_end_session(request);
-  } else {
-    http_session(request);
-  }
+  http_session((http_request_t*)ev->udata);
 }
 
 void hs_server_init(http_server_t* serv) {
@@ -1584,6 +2077,14 @@ void hs_server_init(http_server_t* serv) {
   struct kevent ev_set;
   EV_SET(&ev_set, 1, EVFILT_TIMER, EV_ADD | EV_ENABLE, 0, 1000, serv);
   kevent(serv->loop, &ev_set, 1, NULL, 0, NULL);
+  EV_SET(&ev_set, 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, serv);
+  kevent(serv->loop, &ev_set, 1, NULL, 0, NULL);
+}
+
+void hs_wake_loop(http_server_t* serv) {
+  struct kevent ev_set;
+  EV_SET(&ev_set, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, serv);
+  kevent(serv->loop, &ev_set, 1, NULL, 0, NULL);
 }
 
 void hs_add_server_sock_events(http_server_t* serv) {
@@ -1592,29 +2093,22 @@ void hs_add_server_sock_events(http_server_t* serv) {
   kevent(serv->loop, &ev_set, 1, NULL, 0, NULL);
 }
 
-int http_server_listen_addr(http_server_t* serv, const char* ipaddr) {
-  http_listen(serv, ipaddr);
-
-  struct kevent ev_list[1];
+void hs_server_run(http_server_t* serv) {
+  struct kevent ev_list[HTTP_MAX_EVENTS];
 
   while (1) {
-    int nev = kevent(serv->loop, NULL, 0, ev_list, 1, NULL);
+    int nev = kevent(serv->loop, NULL, 0, ev_list, HTTP_MAX_EVENTS, NULL);
     for (int i = 0; i < nev; i++) {
       ev_cb_t* ev_cb = (ev_cb_t*)ev_list[i].udata;
       ev_cb->handler(&ev_list[i]);
     }
+    hs_free_closed_sessions(serv);
   }
-  return 0;
-}
-
-int http_server_listen(http_server_t* serv) {
-  return http_server_listen_addr(serv, NULL);
 }
 
 void hs_delete_events(http_request_t* request) {
-  struct kevent ev_set;
-  EV_SET(&ev_set, request->socket, EVFILT_TIMER, EV_DELETE, 0, 0, request);
-  kevent(request->server->loop, &ev_set, 1, NULL, 0, NULL);
+  // The socket events are removed when the socket is closed.
+  (void)request;
 }
 
 int http_server_poll(http_server_t* serv) {
@@ -1624,14 +2118,14 @@ int http_server_poll(http_server_t* serv) {
   if (nev <= 0) return nev;
   ev_cb_t* ev_cb = (ev_cb_t*)ev.udata;
   ev_cb->handler(&ev);
+  hs_free_closed_sessions(serv);
   return nev;
 }
 
 void hs_add_events(http_request_t* request) {
-  struct kevent ev_set[2];
-  EV_SET(&ev_set[0], request->socket, EVFILT_READ, EV_ADD, 0, 0, request);
-  EV_SET(&ev_set[1], request->socket, EVFILT_TIMER, EV_ADD | EV_ENABLE, 0, 1000, request);
-  kevent(request->server->loop, ev_set, 2, NULL, 0, NULL);
+  struct kevent ev_set;
+  EV_SET(&ev_set, request->socket, EVFILT_READ, EV_ADD, 0, 0, request);
+  kevent(request->server->loop, &ev_set, 1, NULL, 0, NULL);
 }
 
 void hs_add_write_event(http_request_t* request) {
@@ -1658,15 +2152,15 @@ void hs_server_timer_cb(struct epoll_event* ev) {
   int bytes = read(server->timerfd, &res, sizeof(res));
   (void)bytes; // suppress warning
   hs_generate_date_time(server->date);
+  hs_timer_tick(server);
 }
 
-void hs_request_timer_cb(struct epoll_event* ev) {
-  http_request_t* request = (http_request_t*)((char*)ev->data.ptr - sizeof(epoll_cb_t));
+void hs_server_completion_cb(struct epoll_event* ev) {
+  http_server_t* server = (http_server_t*)((char*)ev->data.ptr - offsetof(http_server_t, completion_handler));
   uint64_t res;
-  int bytes = read(request->timerfd, &res, sizeof(res));
+  int bytes = read(server->completionfd, &res, sizeof(res));
   (void)bytes; // suppress warning
-  request->timeout -= 1;
-  if (request->timeout == 0) hs_end_session(request);
+  hs_process_completions(server);
 }
 
 void hs_add_server_sock_events(http_server_t* serv) {
@@ -1691,29 +2185,35 @@ void hs_server_init(http_server_t* serv) {
   ev.data.ptr = &serv->timer_handler;
   epoll_ctl(serv->loop, EPOLL_CTL_ADD, tfd, &ev);
   serv->timerfd = tfd;
+
+  // Woken up by http_respond_async
+  serv->completion_handler = hs_server_completion_cb;
+  serv->completionfd = eventfd(0, EFD_NONBLOCK);
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = &serv->completion_handler;
+  epoll_ctl(serv->loop, EPOLL_CTL_ADD, serv->completionfd, &ev);
 }
 
-int http_server_listen_addr(http_server_t* serv, const char* ipaddr) {
-  http_listen(serv, ipaddr);
-  struct epoll_event ev_list[1];
+void hs_wake_loop(http_server_t* serv) {
+  uint64_t one = 1;
+  int bytes = write(serv->completionfd, &one, sizeof(one));
+  (void)bytes; // suppress warning
+}
+
+void hs_server_run(http_server_t* serv) {
+  struct epoll_event ev_list[HTTP_MAX_EVENTS];
   while (1) {
-    int nev = epoll_wait(serv->loop, ev_list, 1, -1);
+    int nev = epoll_wait(serv->loop, ev_list, HTTP_MAX_EVENTS, -1);
     for (int i = 0; i < nev; i++) {
       ev_cb_t* ev_cb = (ev_cb_t*)ev_list[i].data.ptr;
       ev_cb->handler(&ev_list[i]);
     }
+    hs_free_closed_sessions(serv);
   }
-  return 0;
-}
-
-int http_server_listen(http_server_t* serv) {
-  return http_server_listen_addr(serv, NULL);
 }
 
 void hs_delete_events(http_request_t* request) {
   epoll_ctl(request->server->loop, EPOLL_CTL_DEL, request->socket, NULL);
-  epoll_ctl(request->server->loop, EPOLL_CTL_DEL, request->timerfd, NULL);
-  close(request->timerfd);
 }
 
 int http_server_poll(http_server_t* serv) {
@@ -1722,29 +2222,16 @@ int http_server_poll(http_server_t* serv) {
   if (nev <= 0) return nev;
   ev_cb_t* ev_cb = (ev_cb_t*)ev.data.ptr;
   ev_cb->handler(&ev);
+  hs_free_closed_sessions(serv);
   return nev;
 }
 
 void hs_add_events(http_request_t* request) {
-  request->timer_handler = hs_request_timer_cb;
-
   // Watch for read events
   struct epoll_event ev;
   ev.events = EPOLLIN | EPOLLET;
   ev.data.ptr = request;
   epoll_ctl(request->server->loop, EPOLL_CTL_ADD, request->socket, &ev);
-
-  // Add timer to timeout requests.
-  int tfd = timerfd_create(CLOCK_MONOTONIC, 0);
-  struct itimerspec ts = {};
-  ts.it_value.tv_sec = 1;
-  ts.it_interval.tv_sec = 1;
-  timerfd_settime(tfd, 0, &ts, NULL);
-
-  ev.events = EPOLLIN | EPOLLET;
-  ev.data.ptr = &request->timer_handler;
-  epoll_ctl(request->server->loop, EPOLL_CTL_ADD, tfd, &ev);
-  request->timerfd = tfd;
 }
 
 void hs_add_write_event(http_request_t* request) {
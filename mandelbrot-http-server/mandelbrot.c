@@ -1,8 +1,11 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <errno.h>
 #include <sys/time.h>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -11,6 +14,21 @@
 #define HTTPSERVER_IMPL
 #include "httpserver.h"
 
+#define MANDEL_IMPLEMENTATION
+#include "mandel.h"
+
+#define CACHE_IMPLEMENTATION
+#include "cache.h"
+
+#define TILE_IMPLEMENTATION
+#include "tile.h"
+
+#define STORE_IMPLEMENTATION
+#include "store.h"
+
+#define FLIGHT_IMPLEMENTATION
+#include "flight.h"
+
 /*
  * for an intro to the Mandelbrot set:
  *   - https://simple.wikipedia.org/wiki/Mandelbrot_set
@@ -23,20 +41,37 @@
  *   macos: brew install imagemagick
  *
  * compile:
- *   $ gcc -std=c99 -Wall -O2 -o mandelbrot mandelbrot.c -lm
+ *   $ gcc -std=c99 -Wall -O2 -o mandelbrot mandelbrot.c -lm -lpthread
  *
  * run:
- *   $ ./mandelbrot
+ *   $ ./mandelbrot [N_THREADS [CACHE_MB]]
+ *
+ * N_THREADS is the number of server threads, each one accepting and serving
+ * its own connections, and of the threads rendering the images (default: one
+ * per core). The last CACHE_MB megabytes of rendered images (default: 64) are
+ * kept in memory and served again without rendering them; the cache counters
+ * can be read at http://127.0.0.1:8080/stats
+ *
+ * If the TILE_STORE environment variable is set, the tiles (see below) are
+ * also written to that file, up to TILE_STORE_MB megabytes (default: 256),
+ * and served from there after a restart (see store.h).
  *
  * and visit:
  *
  *    http://127.0.0.1:8080/800/600/-2/-1/1/1
+ *
+ * or ask for 256x256 tiles, as map viewers do (see tile.h):
+ *
+ *    http://127.0.0.1:8080/tile/2/1/1.png
  */
 
 /* --------------------------------------------------------------------
  *   MACROS AND CONSTANTS
  * -------------------------------------------------------------------- */
 
+#define DEFAULT_CACHE_MB 64
+#define DEFAULT_TILE_STORE_MB 256
+
 /* --------------------------------------------------------------------
  *   TYPES
  * -------------------------------------------------------------------- */
@@ -63,6 +98,8 @@ typedef struct image {
  *   CODE
  * -------------------------------------------------------------------- */
 
+// image_new() allocates a width x height image, with its pixels left
+// uninitialized
 img_t *image_new(int width, int height)
 {
 	img_t *img = (img_t *)malloc(sizeof(img_t));
@@ -111,24 +148,97 @@ void get_pixel(img_t *img, int x, int y, uint8_t *r, uint8_t *g, uint8_t *b)
 		*b = img->data[pixelOffset + 2];
 }
 
+// image_fill() sets every pixel of img to (r, g, b): with a memset if the
+// three bytes are equal, otherwise by filling the image with copies of its
+// first pixel of doubling size
 void image_fill(img_t *img, uint8_t r, uint8_t g, uint8_t b)
 {
-	for (int y = 0; y < img->height; y++) {
-		for (int x = 0; x < img->width; x++) {
-			set_pixel(img, x, y, r, g, b);
+	size_t imageDataSize = image_stride(img) * (size_t)img->height;
+	if (imageDataSize == 0)
+		return;
+
+	if (r == g && g == b) {
+		memset(img->data, r, imageDataSize);
+		return;
+	}
+	set_pixel(img, 0, 0, r, g, b);
+	for (size_t filled = 3; filled < imageDataSize; filled *= 2)
+		memcpy(img->data + filled, img->data, filled < imageDataSize - filled ? filled : imageDataSize - filled);
+}
+
+// growable in-memory buffer, e.g. for an encoded PNG
+typedef struct image_buf {
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+} img_buf_t;
+
+void image_buf_write(void *context, void *data, int size)
+{
+	img_buf_t *buf = (img_buf_t *)context;
+	if (!buf->data && buf->capacity)
+		return;		/* a previous write failed */
+	size_t needed = buf->size + (size_t)size;
+	if (needed > buf->capacity) {
+		size_t capacity = buf->capacity ? buf->capacity : 4096;
+		while (capacity < needed)
+			capacity *= 2;
+		uint8_t *data = (uint8_t *)realloc(buf->data, capacity);
+		if (!data) {
+			free(buf->data);
+			buf->data = NULL;
+			buf->size = 0;
+			return;
 		}
+		buf->data = data;
+		buf->capacity = capacity;
 	}
+	memcpy(buf->data + buf->size, data, (size_t)size);
+	buf->size = needed;
 }
 
-int image_save_png(img_t *img, const char *filename) {
-	return stbi_write_png(filename, img->width, img->height, 3, img->data, (int)image_stride(img));
+// image_encode_png() appends the PNG encoding of img to buf (which must be
+// zeroed or previously used); returns 0 on failure
+int image_encode_png(img_t *img, img_buf_t *buf) {
+	if (!stbi_write_png_to_func(image_buf_write, buf, img->width, img->height, 3, img->data, (int)image_stride(img)))
+		return 0;
+	return buf->data != NULL;
+}
+
+void image_buf_free(img_buf_t *buf) {
+	free(buf->data);
+	memset(buf, 0, sizeof(img_buf_t));
 }
 
 #define MAX_ITER 100
 
-double complex_sq_abs(double re, double im)
+// the palette in use, part of the keys of the stored tiles
+#define PALETTE_GREY 0
+
+// the colour of every iteration count, see palette_init()
+uint8_t palette[MAX_ITER + 1][3];
+
+// palette_init() computes the grey of every iteration count once, from white
+// for the points escaping at once to black for the ones in the set
+void palette_init(void)
 {
-	return (re * re) + (im * im);
+	for (int n = 0; n <= MAX_ITER; n++) {
+		int color = 255 - (int)((double)n * 255.0 / (double)MAX_ITER);
+		palette[n][0] = palette[n][1] = palette[n][2] = (uint8_t)color;
+	}
+}
+
+// colorize_row() colours row y of img with the iteration counts in iters,
+// one per pixel, through the palette
+void colorize_row(img_t *img, int y, const uint16_t *iters)
+{
+	uint8_t *row = img->data + (size_t)y * image_stride(img);
+	for (int x = 0; x < img->width; x++) {
+		const uint8_t *color = palette[iters[x] < MAX_ITER ? iters[x] : MAX_ITER];
+		row[3 * x + 0] = color[0];
+		row[3 * x + 1] = color[1];
+		row[3 * x + 2] = color[2];
+	}
 }
 
 // time_ms() returns the number of ms since epoch (1 jan 1970)
@@ -139,32 +249,6 @@ double time_ms(void)
 	return ((t.tv_sec * (double)1000.0) + (t.tv_usec / (double)1000.0));
 }
 
-int mandelbrot(double c_re, double c_im)
-{
-	// z_0 = 0
-	// z_{n+1} = (z_n)^2 + c
-	// it's in the mandelbrot set if |z_n| < 2 after MAX_ITER
-
-	// |z| = |x+yi| = sqrt(x*x + y*y)
-	// (a+bi)(c+di) = ac + adi + bci + bdi^2 = (ac−bd) + (ad+bc)i
-	// z^2 = (x+yi)^2 = (x^2-y^2) + (xy+yx)i = (x^2-y^2) + 2xyi
-
-	double z_re = 0.0, z_im = 0.0;
-	double z_new_re = 0.0, z_new_im = 0.0;
-	int n = 0;
-	while (n < MAX_ITER) {
-		if (complex_sq_abs(z_re, z_im) > 4.0)
-			break;
-		// z_{n+1} = (z_n)^2 + c
-		z_new_re = ((z_re * z_re) - (z_im * z_im)) + c_re;
-		z_new_im = 2 * z_re * z_im + c_im;
-
-		z_re = z_new_re;
-		z_im = z_new_im;
-		n++;
-	}
-	return n;
-}
 
 #define RESPONSE "" \
 "<html lang=en>" \
@@ -180,89 +264,326 @@ int mandelbrot(double c_re, double c_im)
       "<li><a href=\"/3000/2000/-2/-1/1/1\">/3000/2000/-2/-1/1/1</a></li>" \
       "<li><a href=\"/3000/2000/4000/3000/-1.2/-0.5/0.3/0.5\">/4000/3000/-1.2/-0.5/0.3/0.5</a></li>" \
     "</ul>" \
+    "<p>oppure un tile 256x256 del tipo /tile/{z}/{x}/{y}.png:</p>" \
+    "<ul>" \
+      "<li><a href=\"/tile/0/0/0.png\">/tile/0/0/0.png</a></li>" \
+      "<li><a href=\"/tile/2/1/1.png\">/tile/2/1/1.png</a></li>" \
+      "<li><a href=\"/tile/5/10/16.png\">/tile/5/10/16.png</a></li>" \
+    "</ul>" \
   "</body>" \
 "</html>"
 #define MAX_URL_LEN 250
-
-void handle_request(struct http_request_s* request) {
+#define MAX_IMAGE_PIXELS (64 * 1024 * 1024)
+#define BAD_REQUEST_RESPONSE "bad image size"
+#define INTERNAL_ERROR_RESPONSE "internal error"
+
+cache_t *cache = NULL;
+store_t *store = NULL;
+// images being rendered, keyed by viewport
+flights_t *flights = NULL;
+
+// parse_viewport() reads the image parameters from an url like
+// /800/600/-2/-1/1/1 (the region may be left out) or /tile/2/1/1.png, in
+// which case the tile is filled in as well (its zoom is -1 otherwise);
+// returns 0 if the url isn't an image url, -1 if the size is not valid (not
+// positive, or more than MAX_IMAGE_PIXELS pixels)
+int parse_viewport(http_string_t url, cache_key_t *viewport, tile_t *tile)
+{
 	char url_str[MAX_URL_LEN + 1];
 
-	double c_start_re = -2.0, c_start_im = -1.0, c_end_re = 1.0, c_end_im = 1.0;
-
-    http_string_t url = http_request_target(request);
+	tile->z = -1;
+	if (url.len > MAX_URL_LEN)
+		return 0;
+	// tiles go through the cache just like any other image with that viewport
+	if (tile_parse(url.buf, (size_t)url.len, tile)) {
+		cache_key_init(viewport, TILE_SIZE, TILE_SIZE, MAX_ITER,
+			tile->c_start_re, tile->c_start_im, tile->c_end_re, tile->c_end_im);
+		return 1;
+	}
+	tile->z = -1;
 	memcpy(url_str, url.buf, url.len);
 	url_str[url.len] = '\0';
-	fprintf(stderr, "url: %s\n", url_str);
 
+	double c_start_re = -2.0, c_start_im = -1.0, c_end_re = 1.0, c_end_im = 1.0;
 	int width = 0, height = 0;
 	if (sscanf(url_str, "/%d/%d/%lg/%lg/%lg/%lg",
 			&width, &height,
 			&c_start_re, &c_start_im, &c_end_re, &c_end_im) < 2) {
-		struct http_response_s* response = http_response_init();
-		http_response_status(response, 200);
-		http_response_header(response, "Content-Type", "text/html");
-		http_response_body(response, RESPONSE, strlen(RESPONSE));
-		http_respond(request, response);
-		return;
+		return 0;
+	}
+	if (width <= 0 || height <= 0 || (int64_t)width * (int64_t)height > MAX_IMAGE_PIXELS)
+		return -1;
+	cache_key_init(viewport, width, height, MAX_ITER, c_start_re, c_start_im, c_end_re, c_end_im);
+	return 1;
+}
+
+void respond_png(struct http_request_s* request, const uint8_t *data, size_t size, void (*free_data)(void *))
+{
+	struct http_response_s* response = http_response_init();
+	http_response_status(response, 200);
+	http_response_header(response, "Content-Type", "image/png");
+	// freed by the server once sent
+	http_response_body_owned(response, (const char *)data, (int)size, free_data);
+	http_respond_async(request, response);
+}
+
+// respond_error() answers request with status and a plain text message; it
+// can be called from the offload threads
+void respond_error(struct http_request_s* request, int status, const char *message)
+{
+	struct http_response_s* response = http_response_init();
+	http_response_status(response, status);
+	http_response_header(response, "Content-Type", "text/plain");
+	http_response_body(response, message, (int)strlen(message));
+	http_respond_async(request, response);
+}
+
+// render_failed() answers with an error the request whose image couldn't be
+// rendered, and the identical ones waiting for it, instead of taking the
+// whole server down
+void render_failed(struct http_request_s* request, cache_key_t *viewport)
+{
+	struct http_request_s* waiter = flight_leave(flights, viewport, sizeof(*viewport));
+	while (waiter) {
+		struct http_request_s* next = (struct http_request_s*)http_request_userdata(waiter);
+		respond_error(waiter, 500, INTERNAL_ERROR_RESPONSE);
+		waiter = next;
 	}
+	respond_error(request, 500, INTERNAL_ERROR_RESPONSE);
+}
+
+// render_request() runs on one of the offload threads
+void render_request(struct http_request_s* request) {
+	cache_key_t viewport;
+	tile_t tile;
+	parse_viewport(http_request_target(request), &viewport, &tile);
+
+	int width = viewport.width, height = viewport.height;
+	double c_start_re = viewport.c_start_re, c_start_im = viewport.c_start_im;
+	double c_end_re = viewport.c_end_re, c_end_im = viewport.c_end_im;
 	fprintf(stderr, "width:%d height:%d\n", width, height);
 	fprintf(stderr, "region (%lg,%lg)-(%lg,%lg)\n", c_start_re, c_start_im, c_end_re, c_end_im);
 
 	img_t *img = image_new(width, height);
 	if (!img) {
 		fprintf(stderr, "ERROR: can't allocate image\n");
-		exit(EXIT_FAILURE);
+		render_failed(request, &viewport);
+		return;
 	}
 
-	image_fill(img, 255, 255, 255);
+	uint16_t *iters = (uint16_t *)malloc((size_t)img->width * sizeof(uint16_t));
+	if (!iters) {
+		fprintf(stderr, "ERROR: can't allocate row buffer\n");
+		image_destroy(img);
+		render_failed(request, &viewport);
+		return;
+	}
 
 	double t_start = time_ms();
-	double c_re, c_im;
+	double c_im;
 	for (int y = 0; y < img->height; y++) {
 		c_im = c_start_im + ((double)y / (double)img->height) * (c_end_im - c_start_im);
 
-		for (int x = 0; x < img->width; x++) {
-			c_re = c_start_re + ((double)x / (double)img->width) * (c_end_re - c_start_re);
-
-			int m = mandelbrot(c_re, c_im);
-			int color = 255 - (int)((double)m * 255.0 / (double)MAX_ITER);
-			set_pixel(img, x, y, (uint8_t)color, (uint8_t)color, (uint8_t)color);
-		}
+		mandel_row(c_start_re, c_end_re, img->width, 0, img->width, c_im, MAX_ITER, iters);
+		colorize_row(img, y, iters);
 	}
 	double t_end = time_ms();
-	fprintf(stderr, "calc time: %lg ms\n", (t_end - t_start));
+	free(iters);
+	fprintf(stderr, "calc time: %lg ms (%s kernel)\n", (t_end - t_start), mandel_kernel_name());
 
 	t_start = time_ms();
-	image_save_png(img, "mandelbrot.png");
+	img_buf_t png;
+	memset(&png, 0, sizeof(png));
+	int encoded = image_encode_png(img, &png);
+	image_destroy(img);
+	if (!encoded) {
+		fprintf(stderr, "ERROR: can't encode PNG data\n");
+		image_buf_free(&png);
+		render_failed(request, &viewport);
+		return;
+	}
 	t_end = time_ms();
 	fprintf(stderr, "write time: %lg ms\n", (t_end - t_start));
+	fprintf(stderr, "png size:%zu\n", png.size);
+
+	size_t size = png.size;
+	if (store && tile.z >= 0) {
+		store_key_t key;
+		store_key_init(&key, tile.z, tile.x, tile.y, MAX_ITER, PALETTE_GREY);
+		if (!store_put(store, &key, png.data, size))
+			fprintf(stderr, "can't write the tile to the store\n");
+	}
+	const uint8_t *cached = cache_put(cache, &viewport, png.data, size);
+
+	// the same image for the identical requests that came in meanwhile
+	struct http_request_s* waiter = flight_leave(flights, &viewport, sizeof(viewport));
+	while (waiter) {
+		struct http_request_s* next = (struct http_request_s*)http_request_userdata(waiter);
+		if (cached) {
+			cache_retain(cached);
+			respond_png(waiter, cached, size, cache_release);
+		} else {
+			uint8_t *copy = (uint8_t *)malloc(size);
+			if (copy) {
+				memcpy(copy, png.data, size);
+				respond_png(waiter, copy, size, free);
+			} else {
+				fprintf(stderr, "ERROR: can't allocate PNG data\n");
+				respond_error(waiter, 500, INTERNAL_ERROR_RESPONSE);
+			}
+		}
+		waiter = next;
+	}
 
-	FILE *fp = fopen("mandelbrot.png", "rb");
-	fseek(fp, 0, SEEK_END);
-	long fileSize = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-	char *pngData = malloc(fileSize);
-	if (!pngData) {
-		fprintf(stderr, "ERROR: can't allocate PNG data memory\n");
-		exit(EXIT_FAILURE);
+	if (cached) {
+		image_buf_free(&png);
+		respond_png(request, cached, size, cache_release);
+	} else {
+		respond_png(request, png.data, png.size, free);
 	}
-	if (fread(pngData, fileSize, 1, fp) != 1) {
-		fprintf(stderr, "ERROR: can't read PNG data into memory\n");
-		exit(EXIT_FAILURE);
+}
+
+void respond_stats(struct http_request_s* request)
+{
+	cache_stats_t stats;
+	cache_get_stats(cache, &stats);
+
+	char body[768];
+	int len = snprintf(body, sizeof(body),
+		"cache hits: %llu\n"
+		"cache misses: %llu\n"
+		"cache evictions: %llu\n"
+		"cache entries: %zu\n"
+		"cache size: %zu/%zu bytes\n",
+		(unsigned long long)stats.hits, (unsigned long long)stats.misses,
+		(unsigned long long)stats.evictions, stats.entries,
+		stats.size, stats.capacity);
+	len += snprintf(body + len, sizeof(body) - (size_t)len,
+		"coalesced requests: %llu\n", (unsigned long long)flight_joined(flights));
+	if (store && len < (int)sizeof(body)) {
+		store_stats_t st;
+		store_get_stats(store, &st);
+		len += snprintf(body + len, sizeof(body) - (size_t)len,
+			"store hits: %llu\n"
+			"store misses: %llu\n"
+			"store compactions: %llu\n"
+			"store entries: %zu\n"
+			"store size: %zu/%zu bytes\n",
+			(unsigned long long)st.hits, (unsigned long long)st.misses,
+			(unsigned long long)st.compactions, st.entries,
+			st.size, st.capacity);
 	}
-	fclose(fp);
-	fprintf(stderr, "file size:%ld\n", fileSize);
 
 	struct http_response_s* response = http_response_init();
 	http_response_status(response, 200);
-	http_response_header(response, "Content-Type", "image/png");
-	http_response_body(response, pngData, fileSize);
+	http_response_header(response, "Content-Type", "text/plain");
+	http_response_body(response, body, len);
 	http_respond(request, response);
-	free(pngData);
 }
 
-int main(void)
+// handle_request() runs on the server loop, which must not be kept busy while
+// the image is rendered: only cached images are sent from here
+void handle_request(struct http_request_s* request) {
+	http_string_t url = http_request_target(request);
+	fprintf(stderr, "url: %.*s\n", url.len, url.buf);
+
+	cache_key_t viewport;
+	tile_t tile;
+	int parsed = parse_viewport(url, &viewport, &tile);
+	if (parsed < 0) {
+		struct http_response_s* response = http_response_init();
+		http_response_status(response, 400);
+		http_response_header(response, "Content-Type", "text/plain");
+		http_response_body(response, BAD_REQUEST_RESPONSE, sizeof(BAD_REQUEST_RESPONSE) - 1);
+		http_respond(request, response);
+		return;
+	}
+	if (!parsed) {
+		if (url.len == 6 && memcmp(url.buf, "/stats", 6) == 0) {
+			respond_stats(request);
+			return;
+		}
+		struct http_response_s* response = http_response_init();
+		http_response_status(response, 200);
+		http_response_header(response, "Content-Type", "text/html");
+		http_response_body(response, RESPONSE, strlen(RESPONSE));
+		http_respond(request, response);
+		return;
+	}
+
+	size_t size;
+	const uint8_t *cached = cache_get(cache, &viewport, &size);
+	if (cached) {
+		fprintf(stderr, "cache hit, png size:%zu\n", size);
+		respond_png(request, cached, size, cache_release);
+		return;
+	}
+	if (store && tile.z >= 0) {
+		store_key_t key;
+		store_key_init(&key, tile.z, tile.x, tile.y, MAX_ITER, PALETTE_GREY);
+		const uint8_t *stored = store_get(store, &key, &size);
+		if (stored) {
+			fprintf(stderr, "store hit, png size:%zu\n", size);
+			respond_png(request, stored, size, store_release);
+			return;
+		}
+	}
+	// the same image is already being rendered, for another client
+	if (!flight_join(flights, &viewport, sizeof(viewport), request)) {
+		fprintf(stderr, "waiting for the render in flight\n");
+		return;
+	}
+	http_request_offload(request, render_request);
+}
+
+int main(int argc, char *argv[])
 {
-	struct http_server_s* server = http_server_init(8080, handle_request);
+	int n_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (argc > 1) {
+		n_threads = atoi(argv[1]);
+	}
+	if (n_threads < 1)
+		n_threads = 1;
+	int cache_mb = DEFAULT_CACHE_MB;
+	if (argc > 2) {
+		cache_mb = atoi(argv[2]);
+	}
+	if (cache_mb < 0)
+		cache_mb = 0;
+
+	palette_init();
+
+	cache = cache_new((size_t)cache_mb * 1024 * 1024);
+	if (!cache) {
+		fprintf(stderr, "ERROR: can't allocate the image cache\n");
+		exit(EXIT_FAILURE);
+	}
+
+	flights = flights_new();
+	if (!flights) {
+		fprintf(stderr, "ERROR: can't allocate the renders table\n");
+		exit(EXIT_FAILURE);
+	}
+
+	const char *store_path = getenv("TILE_STORE");
+	if (store_path && strcmp(store_path, "") != 0) {
+		int store_mb = DEFAULT_TILE_STORE_MB;
+		const char *store_mb_str = getenv("TILE_STORE_MB");
+		if (store_mb_str && strcmp(store_mb_str, "") != 0)
+			store_mb = atoi(store_mb_str);
+		double t_start = time_ms();
+		store = store_open(store_path, (size_t)(store_mb > 0 ? store_mb : 1) * 1024 * 1024);
+		if (!store) {
+			fprintf(stderr, "ERROR: can't open the tile store %s: %s\n", store_path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		store_stats_t stats;
+		store_get_stats(store, &stats);
+		fprintf(stderr, "tile store %s: %zu tiles (%lg ms)\n", store_path, stats.entries, time_ms() - t_start);
+	}
+
+	fprintf(stderr, "listening on port 8080 (%d threads, %s kernel)...\n", n_threads, mandel_kernel_name());
+	struct http_server_s* server = http_server_init_threads(8080, handle_request, n_threads);
+	http_server_set_offload_threads(server, n_threads);
 	http_server_listen(server);
 }
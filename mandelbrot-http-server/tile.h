@@ -0,0 +1,103 @@
+#ifndef TILE_H
+#define TILE_H
+
+/*
+ * Quadtree of square tiles over the complex plane, addressed by urls like
+ * /tile/{z}/{x}/{y}.png as web map viewers do.
+ *
+ * The zoom level 0 has a single tile covering the square (-2.5,-2)-(1.5,2),
+ * which contains the whole Mandelbrot set; every tile of level z is split
+ * into 4 tiles of level z + 1, so level z has 2^z x 2^z tiles, x growing
+ * with the real part and y with the imaginary part (as the image rows do).
+ * Every tile is TILE_SIZE x TILE_SIZE pixels, and adjacent tiles share their
+ * edge, so that they can be laid side by side.
+ *
+ * Do this:
+ *   #define TILE_IMPLEMENTATION
+ * before including this file in *one* C file to create the implementation.
+ */
+
+#include <stddef.h>
+
+/* --------------------------------------------------------------------
+ *   MACROS AND CONSTANTS
+ * -------------------------------------------------------------------- */
+
+#define TILE_SIZE 256
+// so that x and y (up to 2^z - 1) fit an int, as in the store keys
+#define TILE_MAX_ZOOM 30
+
+#define TILE_ROOT_RE -2.5
+#define TILE_ROOT_IM -2.0
+#define TILE_ROOT_SIZE 4.0
+
+/* --------------------------------------------------------------------
+ *   TYPES
+ * -------------------------------------------------------------------- */
+
+typedef struct tile {
+	int z;
+	int x;
+	int y;
+	// region of the complex plane covered by the tile
+	double c_start_re;
+	double c_start_im;
+	double c_end_re;
+	double c_end_im;
+} tile_t;
+
+/* --------------------------------------------------------------------
+ *   PROTOTYPES
+ * -------------------------------------------------------------------- */
+
+// tile_parse() reads a tile url (not nul terminated) and computes the
+// region of the tile; returns 0 if the url isn't a valid tile url
+int tile_parse(const char *url, size_t len, tile_t *tile);
+
+#endif /* TILE_H */
+
+#ifdef TILE_IMPLEMENTATION
+#ifndef TILE_IMPLEMENTATION_ONCE
+#define TILE_IMPLEMENTATION_ONCE
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+/* --------------------------------------------------------------------
+ *   CODE
+ * -------------------------------------------------------------------- */
+
+int tile_parse(const char *url, size_t len, tile_t *tile)
+{
+	char url_str[64];
+	int end = 0;
+	long long x, y;
+
+	if (len >= sizeof(url_str))
+		return 0;
+	memcpy(url_str, url, len);
+	url_str[len] = '\0';
+
+	// %n makes sure nothing follows ".png"; the field widths keep sscanf
+	// from overflowing, which would be undefined
+	if (sscanf(url_str, "/tile/%3d/%18lld/%18lld.png%n", &tile->z, &x, &y, &end) != 3 || (size_t)end != len)
+		return 0;
+	if (tile->z < 0 || tile->z > TILE_MAX_ZOOM)
+		return 0;
+	long long n = 1LL << tile->z;
+	if (x < 0 || x >= n || y < 0 || y >= n)
+		return 0;
+	tile->x = (int)x;
+	tile->y = (int)y;
+
+	double size = ldexp(TILE_ROOT_SIZE, -tile->z);
+	tile->c_start_re = TILE_ROOT_RE + size * (double)tile->x;
+	tile->c_start_im = TILE_ROOT_IM + size * (double)tile->y;
+	tile->c_end_re = tile->c_start_re + size;
+	tile->c_end_im = tile->c_start_im + size;
+	return 1;
+}
+
+#endif /* TILE_IMPLEMENTATION_ONCE */
+#endif /* TILE_IMPLEMENTATION */